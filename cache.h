@@ -0,0 +1,271 @@
+/* See LICENSE for licence details. */
+/*
+	timeline cache
+
+	compiled timelines are stored in $XDG_CACHE_HOME/yasp (or ~/.cache/yasp),
+	one file per input named after the FNV-1a hash of its content:
+
+		[HEADER]   struct cache_header_t (CACHE_HEADER_SIZE bytes)
+		[GROUP]    struct tl_group_t * groups
+		[KEYFRAME] struct keyframe_t * keyframes
+		[UPLOAD]   struct tl_upload_t * uploads
+		[BLOCK]    struct tl_block_t * blocks
+		[FRAME]    SPFM_FRAME_SIZE bytes * frames
+		[DATA]     data_size bytes
+
+	a cached file is mapped as is: on a hit nothing is parsed or copied,
+	timeline_play() walks the mapping. any mismatch (magic, version, hash,
+	input size, layout) is a miss and the entry is compiled and written again.
+	entries are written to a temporary file and renamed, so a reader never
+	sees a partial one
+*/
+
+enum cache_misc_t {
+	CACHE_VERSION     = 9, /* bump whenever the timeline layout or its meaning changes */
+	CACHE_HEADER_SIZE = 128,
+	CACHE_PATH_MAX    = 512,
+};
+
+const char cache_magic[8] = {'Y', 'A', 'S', 'P', 'T', 'L', '\0', '\0'};
+
+struct cache_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t frame_size;  /* SPFM_FRAME_SIZE */
+	uint64_t hash;        /* FNV-1a of the input file */
+	uint64_t input_size;  /* bytes */
+	uint64_t end;         /* timeline_t.end */
+	uint32_t frames, groups;
+	uint64_t loop_time;   /* timeline_t.loop_time */
+	uint32_t loop_group;  /* timeline_t.loop_group */
+	uint32_t keyframes, uploads;
+	uint32_t blocks, data_size;
+	uint8_t chip[SPFM_MAX_SLOT]; /* timeline_t.chip */
+	uint8_t reserved[CACHE_HEADER_SIZE - 76 - SPFM_MAX_SLOT];
+};
+
+/* cache directory (created on demand), false if there is no usable one */
+bool cache_dir(char *dir, size_t size)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	int len, sub;
+
+	if (xdg && xdg[0] != '\0')
+		len = snprintf(dir, size, "%s", xdg);
+	else if (home && home[0] != '\0')
+		len = snprintf(dir, size, "%s/.cache", home);
+	else
+		return false;
+
+	if (len < 0 || (size_t) len >= size)
+		return false;
+	mkdir(dir, 0755);
+
+	if ((sub = snprintf(dir + len, size - len, "/yasp")) < 0 || (size_t) sub >= size - len)
+		return false;
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		logging(WARN, "cache: couldn't create \"%s\": %s\n", dir, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool cache_path(char *path, size_t size, uint64_t hash)
+{
+	char dir[CACHE_PATH_MAX];
+	int len;
+
+	if (!cache_dir(dir, sizeof(dir)))
+		return false;
+
+	len = snprintf(path, size, "%s/%.16llX.tl", dir, (unsigned long long) hash);
+	return (len > 0 && (size_t) len < size);
+}
+
+size_t cache_file_size(const struct cache_header_t *hdr)
+{
+	return CACHE_HEADER_SIZE + (size_t) hdr->groups * sizeof(struct tl_group_t)
+		+ (size_t) hdr->keyframes * sizeof(struct keyframe_t)
+		+ (size_t) hdr->uploads * sizeof(struct tl_upload_t)
+		+ (size_t) hdr->blocks * sizeof(struct tl_block_t)
+		+ (size_t) hdr->frames * SPFM_FRAME_SIZE + hdr->data_size;
+}
+
+/* every group must point inside the frame array, in order */
+bool cache_check_groups(const struct tl_group_t *group, uint32_t groups, uint32_t frames)
+{
+	uint32_t next = 0;
+
+	for (uint32_t i = 0; i < groups; i++) {
+		if (group[i].first != next || group[i].count > frames - next
+			|| (i > 0 && group[i].time < group[i - 1].time))
+			return false;
+		next += group[i].count;
+	}
+	return next == frames;
+}
+
+bool cache_check_chip(const uint8_t *chip)
+{
+	for (int slot = 0; slot < SPFM_MAX_SLOT; slot++) {
+		if (chip[slot] > CHIP_OPNA)
+			return false;
+	}
+	return true;
+}
+
+/* data blocks must point inside data[], in frame order */
+bool cache_check_blocks(const struct tl_block_t *block, uint32_t blocks, uint32_t frames, uint32_t data_size)
+{
+	for (uint32_t i = 0; i < blocks; i++) {
+		if (block[i].frame > frames || block[i].offset > data_size
+			|| block[i].size > data_size - block[i].offset
+			|| (i > 0 && block[i].frame < block[i - 1].frame))
+			return false;
+	}
+	return true;
+}
+
+/* keyframes and uploads must point inside the timeline */
+bool cache_check_index(const struct keyframe_t *kf, uint32_t keyframes,
+	const struct tl_upload_t *upload, uint32_t uploads, uint32_t groups, uint32_t frames)
+{
+	for (uint32_t i = 0; i < keyframes; i++) {
+		if (kf[i].group >= groups || (i > 0 && kf[i].time < kf[i - 1].time))
+			return false;
+	}
+	for (uint32_t i = 0; i < uploads; i++) {
+		if (upload[i].first >= frames || upload[i].count > frames - upload[i].first)
+			return false;
+	}
+	return true;
+}
+
+/* map the cached timeline of the input, false on a miss */
+bool cache_load(struct timeline_t *tl, uint64_t hash, size_t input_size)
+{
+	int fd;
+	struct stat st;
+	char path[CACHE_PATH_MAX];
+	const struct cache_header_t *hdr;
+	uint8_t *map, *p, *index;
+
+	if (!cache_path(path, sizeof(path), hash))
+		return false;
+
+	/* a miss is the normal case: no error message */
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < CACHE_HEADER_SIZE) {
+		eclose(fd);
+		return false;
+	}
+
+	map = emmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | (opt.realtime ? MAP_POPULATE: 0), fd, 0);
+	eclose(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr   = (const struct cache_header_t *) map;
+	index = map + CACHE_HEADER_SIZE + (size_t) hdr->groups * sizeof(struct tl_group_t);
+	if (memcmp(hdr->magic, cache_magic, sizeof(cache_magic)) != 0
+		|| !cache_check_chip(hdr->chip)
+		|| hdr->version != CACHE_VERSION || hdr->frame_size != SPFM_FRAME_SIZE
+		|| hdr->hash != hash || hdr->input_size != input_size
+		|| (size_t) st.st_size != cache_file_size(hdr)
+		|| hdr->loop_group > hdr->groups || hdr->loop_time > hdr->end
+		|| !cache_check_groups((const struct tl_group_t *) (map + CACHE_HEADER_SIZE),
+			hdr->groups, hdr->frames)
+		|| !cache_check_index((const struct keyframe_t *) index, hdr->keyframes,
+			(const struct tl_upload_t *) (index + (size_t) hdr->keyframes * sizeof(struct keyframe_t)),
+			hdr->uploads, hdr->groups, hdr->frames)
+		|| !cache_check_blocks((const struct tl_block_t *) (index
+			+ (size_t) hdr->keyframes * sizeof(struct keyframe_t)
+			+ (size_t) hdr->uploads * sizeof(struct tl_upload_t)), hdr->blocks,
+			hdr->frames, hdr->data_size)) {
+		logging(INFO, "cache: stale entry \"%s\", compiling again\n", path);
+		emunmap(map, st.st_size);
+		return false;
+	}
+
+	memset(tl, 0, sizeof(struct timeline_t));
+	p = map + CACHE_HEADER_SIZE;
+	tl->group      = (struct tl_group_t *) p;
+	tl->groups     = tl->group_cap = hdr->groups;
+	p += (size_t) hdr->groups * sizeof(struct tl_group_t);
+	tl->keyframe   = (struct keyframe_t *) p;
+	tl->keyframes  = tl->keyframe_cap = hdr->keyframes;
+	p += (size_t) hdr->keyframes * sizeof(struct keyframe_t);
+	tl->upload     = (struct tl_upload_t *) p;
+	tl->uploads    = tl->upload_cap = hdr->uploads;
+	p += (size_t) hdr->uploads * sizeof(struct tl_upload_t);
+	tl->block      = (struct tl_block_t *) p;
+	tl->blocks     = tl->block_cap = hdr->blocks;
+	p += (size_t) hdr->blocks * sizeof(struct tl_block_t);
+	tl->frame      = p;
+	tl->frames     = tl->frame_cap = hdr->frames;
+	p += (size_t) hdr->frames * SPFM_FRAME_SIZE;
+	tl->data       = p;
+	tl->data_size  = tl->data_cap = hdr->data_size;
+	tl->end        = hdr->end;
+	tl->loop_group = hdr->loop_group;
+	tl->loop_time  = hdr->loop_time;
+	memcpy(tl->chip, hdr->chip, SPFM_MAX_SLOT);
+	tl->map        = map;
+	tl->map_size   = st.st_size;
+
+	logging(INFO, "cache: hit \"%s\" (%u frame(s) in %u group(s))\n", path, tl->frames, tl->groups);
+	return true;
+}
+
+/* write the compiled timeline of the input (failures only cost the next start) */
+void cache_store(const struct timeline_t *tl, uint64_t hash, size_t input_size)
+{
+	int fd;
+	bool ok;
+	char path[CACHE_PATH_MAX], tmp[CACHE_PATH_MAX + 32];
+	struct cache_header_t hdr;
+
+	if (!cache_path(path, sizeof(path), hash))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+
+	memset(&hdr, 0, sizeof(struct cache_header_t));
+	memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+	hdr.version    = CACHE_VERSION;
+	hdr.frame_size = SPFM_FRAME_SIZE;
+	hdr.hash       = hash;
+	hdr.input_size = input_size;
+	hdr.end        = tl->end;
+	hdr.frames     = tl->frames;
+	hdr.groups     = tl->groups;
+	hdr.loop_time  = tl->loop_time;
+	hdr.loop_group = tl->loop_group;
+	hdr.keyframes  = tl->keyframes;
+	hdr.uploads    = tl->uploads;
+	hdr.blocks     = tl->blocks;
+	hdr.data_size  = tl->data_size;
+	memcpy(hdr.chip, tl->chip, SPFM_MAX_SLOT);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		logging(WARN, "cache: couldn't create \"%s\": %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	ok = ewrite(fd, &hdr, sizeof(struct cache_header_t)) >= 0
+		&& (tl->groups == 0 || ewrite(fd, tl->group, (size_t) tl->groups * sizeof(struct tl_group_t)) >= 0)
+		&& (tl->keyframes == 0 || ewrite(fd, tl->keyframe, (size_t) tl->keyframes * sizeof(struct keyframe_t)) >= 0)
+		&& (tl->uploads == 0 || ewrite(fd, tl->upload, (size_t) tl->uploads * sizeof(struct tl_upload_t)) >= 0)
+		&& (tl->blocks == 0 || ewrite(fd, tl->block, (size_t) tl->blocks * sizeof(struct tl_block_t)) >= 0)
+		&& (tl->frames == 0 || ewrite(fd, tl->frame, (size_t) tl->frames * SPFM_FRAME_SIZE) >= 0)
+		&& (tl->data_size == 0 || ewrite(fd, tl->data, tl->data_size) >= 0);
+
+	if (eclose(fd) < 0 || !ok || rename(tmp, path) < 0) {
+		logging(WARN, "cache: couldn't write \"%s\"\n", path);
+		unlink(tmp);
+		return;
+	}
+
+	logging(DEBUG, "cache: stored \"%s\"\n", path);
+}
@@ -0,0 +1,450 @@
+/* See LICENSE for licence details. */
+/*
+	daemon mode (-D SOCKET) and its client (-C SOCKET)
+
+	the daemon keeps the serial session (and with it the register shadow
+	and the ADPCM RAM model) open and plays a queue of files. it listens
+	on a unix domain socket, one command per connection, one line each way:
+
+		enqueue PATH : append PATH to the queue
+		play         : play the queue (or resume)
+		pause        : pause the track
+		stop         : stop the track, don't start the next one
+		skip         : stop the track, play the next one
+		status       : state, track, position and queue
+
+	the reply is "ok" or "error", then the message. the socket and the
+	clients are served by the timing thread from the loop (loop_wait(),
+	and loop_serve() during an upload), and never block it: a
+	client is read as far as it has sent, and answered once its line is
+	complete. while a track plays the timing thread sleeps between
+	events, so a command takes effect at the next wakeup. a file is
+	opened (compiled) on a thread, while commands are served
+*/
+
+enum control_misc_t {
+	CONTROL_MAX_QUEUE   = 256,
+	CONTROL_MAX_LINE    = 4096 + 16,  /* PATH_MAX and the command */
+	CONTROL_MAX_CLIENT  = 8,
+	CONTROL_TIMEOUT     = 1000, /* msec: a client still without a line may lose its slot */
+	CONTROL_BACKLOG     = 8,
+	CONTROL_STATUS      = 16,   /* queued files listed by status */
+	CONTROL_OPEN_POLL   = 1,    /* msec: how often a file being opened is checked */
+};
+
+/* a connection whose line is being read */
+struct control_client_t {
+	int fd;         /* -1: free */
+	size_t len;
+	uint64_t since; /* accepted at (monotonic nsec) */
+	char line[CONTROL_MAX_LINE];
+};
+
+struct control_t {
+	int fd;
+	const char *path;
+	struct control_client_t client[CONTROL_MAX_CLIENT];
+
+	char *queue[CONTROL_MAX_QUEUE]; /* ring of strdup()ed paths */
+	int head, count;
+	bool play;     /* play the queue (false: idle until "play") */
+
+	/* track being played (current: NULL if none) */
+	char *current;
+	uint64_t origin; /* monotonic time of position 0 (0: not started) */
+	uint64_t end;    /* length (nsec, 0: unknown) */
+};
+
+struct control_t control = { .fd = -1 };
+
+bool control_enqueue(const char *path)
+{
+	char *dup;
+
+	if (control.count >= CONTROL_MAX_QUEUE || (dup = strdup(path)) == NULL)
+		return false;
+
+	control.queue[(control.head + control.count++) % CONTROL_MAX_QUEUE] = dup;
+	return true;
+}
+
+/* the caller frees it */
+char *control_dequeue(void)
+{
+	char *path = control.queue[control.head];
+
+	control.head = (control.head + 1) % CONTROL_MAX_QUEUE;
+	control.count--;
+	return path;
+}
+
+/* position in the track (nsec): pauses don't count */
+uint64_t control_position(void)
+{
+	uint64_t now = loop.paused ? loop.pause_start: now_nsec();
+
+	return (control.origin != 0 && now > control.origin + loop.shift) ? now - control.origin - loop.shift: 0;
+}
+
+void control_status(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "ok %s\n", control.current ? (loop.paused ? "paused": "playing"):
+		(control.play ? "idle (waiting for a file)": "stopped"));
+
+	if (control.current) {
+		fprintf(fp, "track: %s (%.1f", control.current, (double) control_position() / NSEC_PER_SEC);
+		if (control.end != 0)
+			fprintf(fp, "/%.1f", (double) control.end / NSEC_PER_SEC);
+		fprintf(fp, " sec)\n");
+	}
+
+	fprintf(fp, "queue: %d file(s)\n", control.count);
+	for (i = 0; i < control.count && i < CONTROL_STATUS; i++)
+		fprintf(fp, "\t%s\n", control.queue[(control.head + i) % CONTROL_MAX_QUEUE]);
+	if (i < control.count)
+		fprintf(fp, "\t(%d more)\n", control.count - i);
+}
+
+/* run the command, write the reply to fp */
+void control_command(FILE *fp, char *line)
+{
+	char *arg;
+
+	if ((arg = strchr(line, ' ')) != NULL)
+		*arg++ = '\0';
+
+	logging(DEBUG, "control: %s%s%s\n", line, arg ? " ": "", arg ? arg: "");
+
+	if (strcmp(line, "enqueue") == 0) {
+		if (arg == NULL || *arg == '\0') {
+			fprintf(fp, "error usage: enqueue PATH\n");
+		} else if (access(arg, R_OK) < 0) {
+			fprintf(fp, "error %s: %s\n", arg, strerror(errno));
+		} else if (!control_enqueue(arg)) {
+			fprintf(fp, "error the queue is full (%d files)\n", CONTROL_MAX_QUEUE);
+		} else {
+			fprintf(fp, "ok %s queued (%d file(s) in the queue)\n", arg, control.count);
+			logging(INFO, "control: \"%s\" queued\n", arg);
+		}
+	} else if (strcmp(line, "play") == 0) {
+		if (control.current && loop.paused)
+			loop_set_paused(false);
+		control.play = true;
+		fprintf(fp, "ok %s\n", control.current ? "playing": (control.count > 0) ? "starting": "waiting for a file");
+	} else if (strcmp(line, "pause") == 0) {
+		if (control.current == NULL) {
+			fprintf(fp, "error nothing is playing\n");
+		} else {
+			loop_set_paused(true);
+			fprintf(fp, "ok paused\n");
+		}
+	} else if (strcmp(line, "stop") == 0 || strcmp(line, "skip") == 0) {
+		control.play = (line[1] == 'k');
+		if (control.current)
+			loop_stop();
+		fprintf(fp, "ok %s\n", control.play ? (control.count > 0 ? "next file": "waiting for a file"): "stopped");
+	} else if (strcmp(line, "status") == 0) {
+		control_status(fp);
+	} else {
+		fprintf(fp, "error unknown command \"%s\" (enqueue, play, pause, stop, skip, status)\n", line);
+	}
+}
+
+/* closing the fd also takes it out of the epoll set */
+void control_drop(struct control_client_t *c)
+{
+	eclose(c->fd);
+	c->fd = -1;
+}
+
+/* the line is complete (or the client is done sending): run it and answer */
+void control_reply(struct control_client_t *c)
+{
+	char *reply = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	c->line[c->len] = '\0';
+	c->line[strcspn(c->line, "\r\n")] = '\0';
+
+	if ((fp = open_memstream(&reply, &size)) != NULL) {
+		control_command(fp, c->line);
+		fclose(fp);
+		/* never block on (or be killed by) a client that went away */
+		if (send(c->fd, reply, size, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+			logging(WARN, "control: send: %s\n", strerror(errno));
+		free(reply);
+	}
+	control_drop(c);
+}
+
+/* read what the client has sent so far */
+void control_receive(struct control_client_t *c)
+{
+	ssize_t ret;
+
+	while ((ret = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len)) < 0 && errno == EINTR);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	if (ret <= 0) {
+		if (ret == 0 && c->len > 0) /* the last line may lack its newline */
+			control_reply(c);
+		else
+			control_drop(c);
+		return;
+	}
+
+	c->len += ret;
+	if (memchr(c->line + c->len - ret, '\n', ret) || c->len == sizeof(c->line) - 1)
+		control_reply(c);
+}
+
+/* a free client slot, or the one of a client silent for CONTROL_TIMEOUT (NULL: none) */
+struct control_client_t *control_slot(void)
+{
+	struct control_client_t *oldest = NULL;
+
+	for (int i = 0; i < CONTROL_MAX_CLIENT; i++) {
+		if (control.client[i].fd == -1)
+			return &control.client[i];
+		if (oldest == NULL || control.client[i].since < oldest->since)
+			oldest = &control.client[i];
+	}
+
+	if (now_nsec() - oldest->since < (uint64_t) CONTROL_TIMEOUT * NSEC_PER_MSEC)
+		return NULL;
+
+	logging(WARN, "control: client sent no command in %d msec: dropped\n", CONTROL_TIMEOUT);
+	control_drop(oldest);
+	return oldest;
+}
+
+void control_event(int fd);
+
+void control_accept(void)
+{
+	int fd;
+	struct control_client_t *c;
+	static const char busy[] = "error too many clients\n";
+
+	while ((fd = accept4(control.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if ((c = control_slot()) == NULL) {
+			(void) !send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+			eclose(fd);
+			continue;
+		}
+		if (!loop_add_control(fd, control_event)) {
+			eclose(fd);
+			continue;
+		}
+		c->fd    = fd;
+		c->len   = 0;
+		c->since = now_nsec();
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		logging(ERROR, "accept4: %s\n", strerror(errno));
+}
+
+/* the socket or a client is readable (called from the loop, timing thread only) */
+void control_event(int fd)
+{
+	if (fd == control.fd) {
+		control_accept();
+		return;
+	}
+
+	for (int i = 0; i < CONTROL_MAX_CLIENT; i++) {
+		if (control.client[i].fd == fd) {
+			control_receive(&control.client[i]);
+			return;
+		}
+	}
+}
+
+bool control_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logging(ERROR, "socket path too long: %s\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	for (int i = 0; i < CONTROL_MAX_CLIENT; i++)
+		control.client[i].fd = -1;
+
+	if ((control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		logging(ERROR, "socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* a daemon that didn't exit cleanly leaves its socket behind */
+	unlink(path);
+
+	if (bind(control.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		|| listen(control.fd, CONTROL_BACKLOG) < 0) {
+		logging(ERROR, "%s: %s\n", path, strerror(errno));
+		eclose(control.fd);
+		control.fd = -1;
+		return false;
+	}
+	control.path = path;
+
+	if (!loop_add_control(control.fd, control_event)) {
+		eclose(control.fd);
+		unlink(path);
+		control.fd = -1;
+		return false;
+	}
+	logging(INFO, "control: listening on %s\n", path);
+	return true;
+}
+
+void control_close(void)
+{
+	for (int i = 0; i < CONTROL_MAX_CLIENT; i++) {
+		if (control.client[i].fd != -1)
+			control_drop(&control.client[i]);
+	}
+
+	if (control.fd != -1) {
+		eclose(control.fd);
+		unlink(control.path);
+	}
+	while (control.count > 0)
+		free(control_dequeue());
+}
+
+/* open the file on a thread (see playlist_prepare()) and serve commands meanwhile */
+bool control_open(struct playlist_t *list, const char *path)
+{
+	if (!playlist_prepare_start(list, 0, path))
+		return track_open(&list->track[0], path);
+
+	while (!__atomic_load_n(&list->done, __ATOMIC_ACQUIRE)) {
+		loop_arm(now_nsec() + (uint64_t) CONTROL_OPEN_POLL * NSEC_PER_MSEC);
+		/* stopped: the decoder gives up soon (catch_sigint), just wait for it */
+		if (!loop_wait())
+			break;
+	}
+	pthread_join(list->thread, NULL);
+
+	return list->ready;
+}
+
+/* play the queue until SIGINT/SIGTERM: files (may be 0) are queued first */
+bool control_run(int serial_fd, const char *path, char **file, int count)
+{
+	static struct playlist_t list;
+	struct track_t *track = &list.track[0];
+	uint64_t finish = 0;
+
+	if (!control_listen(path))
+		return false;
+
+	for (int i = 0; i < count; i++) {
+		if (!control_enqueue(file[i]))
+			logging(WARN, "control: \"%s\" not queued\n", file[i]);
+	}
+	control.play = (count > 0);
+
+	while (!loop.quit) {
+		/* idle: only a command or a signal wakes us up */
+		if (!control.play || control.count == 0) {
+			finish = 0;
+			loop_arm(0);
+			loop_wait();
+			continue;
+		}
+
+		control.current = control_dequeue();
+		control.origin  = control.end = 0;
+
+		if (!control_open(&list, control.current)) {
+			logging(WARN, "couldn't open \"%s\"\n", control.current);
+			finish = 0;
+		} else if (catch_sigint) {
+			/* stop/skip while it was being opened */
+			track_close(track);
+		} else {
+			control.end = track->streamed ? 0: track->tl.end;
+			track_start(serial_fd, track, 0);
+			playlist_chain(track, finish, control.current);
+			control.origin = track->origin ? track->origin: now_nsec();
+
+			track_output(serial_fd, track);
+			finish = track->finish;
+			track_close(track);
+		}
+		free(control.current);
+		control.current = NULL;
+
+		/* stop/skip: playback goes on, from a clean state */
+		if (catch_sigint && !loop.quit) {
+			loop_clear_stop();
+			spfm_shadow_forget();
+			finish = 0;
+		}
+		loop.paused = false;
+		spfm_silence(serial_fd);
+	}
+
+	control_close();
+	return true;
+}
+
+/* client: send "command [arg]" to the daemon, print the reply */
+int control_client(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char line[CONTROL_MAX_LINE], buf[BUFSIZ], *arg = NULL, resolved[PATH_MAX];
+	int fd, len;
+	ssize_t size;
+	bool ok = false, first = true;
+
+	if (argc < 1 || argc > 2) {
+		fprintf(stderr, "usage: yasp -C SOCKET enqueue PATH|play|pause|stop|skip|status\n");
+		return EXIT_FAILURE;
+	}
+
+	/* the daemon has another working directory */
+	if (argc == 2)
+		arg = (strcmp(argv[0], "enqueue") == 0 && realpath(argv[1], resolved)) ? resolved: argv[1];
+
+	len = snprintf(line, sizeof(line), "%s%s%s\n", argv[0], arg ? " ": "", arg ? arg: "");
+	if (len < 0 || len >= (int) sizeof(line) || strlen(path) >= sizeof(addr.sun_path)) {
+		logging(ERROR, "command or socket path too long\n");
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+		|| connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		logging(ERROR, "%s: %s\n", path, strerror(errno));
+		if (fd != -1)
+			eclose(fd);
+		return EXIT_FAILURE;
+	}
+
+	if (ewrite(fd, line, len) != len) {
+		eclose(fd);
+		return EXIT_FAILURE;
+	}
+	shutdown(fd, SHUT_WR);
+
+	while ((size = eread(fd, buf, sizeof(buf))) > 0) {
+		if (first)
+			ok = (size >= 2 && strncmp(buf, "ok", 2) == 0);
+		first = false;
+		fwrite(buf, 1, size, stdout);
+	}
+	eclose(fd);
+
+	return ok ? EXIT_SUCCESS: EXIT_FAILURE;
+}
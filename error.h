@@ -1,9 +1,5 @@
 /* See LICENSE for licence details. */
 
-enum error_setting_t {
-	SLEEP_TIME = 30000, /* sleep time at EAGAIN, EWOULDBLOCK (usec) */
-};
-
 /* logging functions */
 enum loglevel_t {
 	DEBUG = 0,
@@ -19,6 +15,7 @@ void logging(enum loglevel_t loglevel, char *format, ...)
 	va_list arg;
 	static const char *loglevel2str[] = {
 		[DEBUG] = "DEBUG",
+		[INFO]  = "INFO",
 		[WARN]  = "WARN",
 		[ERROR] = "ERROR",
 		[FATAL] = "FATAL",
@@ -93,7 +90,6 @@ int efclose(FILE *fp)
 	return ret;
 }
 
-/*
 void *emmap(void *addr, size_t len, int prot, int flag, int fd, off_t offset)
 {
 	void *fp;
@@ -116,39 +112,42 @@ int emunmap(void *ptr, size_t len)
 	return ret;
 }
 
-void *ecalloc(size_t nmemb, size_t size)
+void *erealloc(void *ptr, size_t size)
 {
-	void *ptr;
+	void *new;
 	errno = 0;
 
-	if ((ptr = calloc(nmemb, size)) == NULL)
-		logging(ERROR, "calloc: %s\n", strerror(errno));
+	if ((new = realloc(ptr, size)) == NULL)
+		logging(ERROR, "realloc: %s\n", strerror(errno));
 
-	return ptr;
+	return new;
 }
 
-void *erealloc(void *ptr, size_t size)
+/*
+void *ecalloc(size_t nmemb, size_t size)
 {
-	void *new;
+	void *ptr;
 	errno = 0;
 
-	if ((new = realloc(ptr, size)) == NULL)
-		logging(ERROR, "realloc: %s\n", strerror(errno));
+	if ((ptr = calloc(nmemb, size)) == NULL)
+		logging(ERROR, "calloc: %s\n", strerror(errno));
 
-	return new;
+	return ptr;
 }
+
 */
 
-int eselect(int maxfd, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *tv)
+/* poll(2), restarted after EINTR */
+int xpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
 	int ret;
 	errno = 0;
 
-	if ((ret = select(maxfd, readfds, writefds, errorfds, tv)) < 0) {
+	if ((ret = poll(fds, nfds, timeout)) < 0) {
 		if (errno == EINTR)
-			return eselect(maxfd, readfds, writefds, errorfds, tv);
+			return xpoll(fds, nfds, timeout);
 		else
-			logging(ERROR, "select: %s\n", strerror(errno));
+			logging(ERROR, "poll: %s\n", strerror(errno));
 	}
 	return ret;
 }
@@ -170,9 +169,11 @@ ssize_t eread(int fd, void *buf, size_t size)
 	errno = 0;
 
 	if ((ret = read(fd, buf, size)) < 0) {
-		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-			logging(ERROR, "read(): interrupt! (EINTR or EAGAIN or EWOULDBLOCK occured), sleep %d usec\n", SLEEP_TIME);
-			usleep(SLEEP_TIME);
+		if (errno == EINTR) {
+			return eread(fd, buf, size);
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			/* wait until readable instead of sleeping blindly */
+			xpoll(&(struct pollfd){ .fd = fd, .events = POLLIN }, 1, -1);
 			return eread(fd, buf, size);
 		} else {
 			logging(ERROR, "read(): %s\n", strerror(errno));
@@ -198,8 +199,8 @@ ssize_t ewrite(int fd, const void *buf, size_t size)
 			logging(ERROR, "write: EINTR occurred\n");
 			return ewrite(fd, buf, size);
 		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			logging(ERROR, "write: EAGAIN or EWOULDBLOCK occurred, sleep %d usec\n", SLEEP_TIME);
-			usleep(SLEEP_TIME);
+			/* wait until writable instead of sleeping blindly */
+			xpoll(&(struct pollfd){ .fd = fd, .events = POLLOUT }, 1, -1);
 			return ewrite(fd, buf, size);
 		} else {
 			logging(ERROR, "write: %s\n", strerror(errno));
@@ -256,7 +257,6 @@ int ecfsetispeed(struct termios *tm, speed_t speed)
 	return ret;
 }
 
-/*
 int eopenpty(int *amaster, int *aslave, char *aname,
 	const struct termios *termp, const struct winsize *winsize)
 {
@@ -287,6 +287,7 @@ int eopenpty(int *amaster, int *aslave, char *aname,
 	return 0;
 }
 
+/*
 pid_t eforkpty(int *amaster, char *name,
 	const struct termios *termp, const struct winsize *winsize)
 {
@@ -0,0 +1,66 @@
+/* See LICENSE for licence details. */
+/*
+	log-bucketed histogram of nsec values
+
+	every power of two is split into HIST_SUB_BUCKETS buckets, so a
+	percentile is known within 1/HIST_SUB_BUCKETS of its value while
+	the whole range (1 nsec .. 2^HIST_MAX_POW2 nsec) fits a small table
+*/
+
+enum hist_misc_t {
+	HIST_SUB_BITS    = 2,
+	HIST_SUB_BUCKETS = 1 << HIST_SUB_BITS,
+	HIST_MAX_POW2    = 40, /* about 18 minutes */
+	HIST_BUCKETS     = HIST_MAX_POW2 * HIST_SUB_BUCKETS,
+};
+
+struct hist_t {
+	uint64_t bucket[HIST_BUCKETS];
+	uint64_t count, max;
+};
+
+int hist_index(uint64_t value)
+{
+	int msb, index;
+
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+
+	msb   = 63 - __builtin_clzll(value);
+	index = msb * HIST_SUB_BUCKETS + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+
+	return (index < HIST_BUCKETS) ? index: HIST_BUCKETS - 1;
+}
+
+/* largest value which falls into the bucket */
+uint64_t hist_upper(int index)
+{
+	int msb = index / HIST_SUB_BUCKETS, sub = index % HIST_SUB_BUCKETS;
+
+	if (index < HIST_SUB_BUCKETS)
+		return index;
+
+	return ((uint64_t) (HIST_SUB_BUCKETS + sub + 1) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+void hist_add(struct hist_t *hist, uint64_t value, uint64_t n)
+{
+	hist->bucket[hist_index(value)] += n;
+	hist->count += n;
+
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/* upper bound of the p-th percentile (0.0 < p <= 1.0) */
+uint64_t hist_percentile(struct hist_t *hist, double p)
+{
+	uint64_t sum = 0, rank = p * hist->count;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		sum += hist->bucket[i];
+		if (sum > 0 && sum >= rank)
+			return (hist_upper(i) < hist->max) ? hist_upper(i): hist->max;
+	}
+	return hist->max;
+}
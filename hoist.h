@@ -0,0 +1,163 @@
+/* See LICENSE for licence details. */
+/*
+	ADPCM upload hoisting
+
+	a data block in the middle of a track is sent while the track plays:
+	everything due during the transfer goes out late, then in a burst.
+	after compiling, every upload found by keyframe_build() gets its RAM
+	range (memory type, start/stop registers), and an upload whose range
+	no other upload of the slot touches is hoisted: hoist_preload() sends
+	it before the first event of the track, in one bulk transfer, and
+	timeline_play() skips its data (data blocks and 0x08 writes).
+
+	only the data moves. whatever else is written during the upload (FM,
+	rhythm, the other slot) stays at its time, and so do the upload
+	registers: they are written in place again, without data, so the
+	register state after the upload is what the track expects. before
+	the track starts, the registers the preload wrote are set back to 0
+	(their value after a reset): until the track writes them itself, it
+	can't rely on anything else.
+
+	an upload sharing RAM with another one stays in place, since moving it
+	would change what the RAM holds when the other one is played. those
+	are reported with the stall they cause (their time on the wire)
+*/
+
+/* fill in the range and the data size of the upload from its frames */
+void hoist_range(const struct timeline_t *tl, struct tl_upload_t *upload)
+{
+	const uint8_t *frame = tl->frame + (size_t) upload->first * SPFM_FRAME_SIZE;
+
+	upload->type = upload->start = upload->stop = 0;
+	upload->size = 0;
+
+	for (uint32_t i = 0; i < upload->count; i++, frame += SPFM_FRAME_SIZE) {
+		if (!tl_upload_owns(upload, frame))
+			continue;
+
+		switch (frame[2]) {
+		case 0x01: upload->type  = frame[3]; break;
+		case 0x02: upload->start = (upload->start & 0xFF00) | frame[3]; break;
+		case 0x03: upload->start = (upload->start & 0x00FF) | (frame[3] << 8); break;
+		case 0x04: upload->stop  = (upload->stop & 0xFF00) | frame[3]; break;
+		case 0x05: upload->stop  = (upload->stop & 0x00FF) | (frame[3] << 8); break;
+		case 0x08: upload->size++; break; /* written register by register */
+		}
+	}
+
+	for (uint32_t b = timeline_block_from(tl, upload->first);
+		b < tl->blocks && tl->block[b].frame < upload->first + upload->count; b++) {
+		if (tl->block[b].slot == upload->slot)
+			upload->size += tl->block[b].size;
+	}
+}
+
+/* same RAM: another memory type has other address units, so any mix counts */
+bool hoist_overlap(const struct tl_upload_t *a, const struct tl_upload_t *b)
+{
+	return a->slot == b->slot
+		&& (a->type != b->type || !(a->stop < b->start || b->stop < a->start));
+}
+
+/* decide which uploads are sent before the track (after keyframe_build()) */
+void hoist_plan(struct timeline_t *tl)
+{
+	for (uint32_t i = 0; i < tl->uploads; i++) {
+		hoist_range(tl, &tl->upload[i]);
+		tl->upload[i].hoisted = true;
+	}
+
+	/* quadratic, but a track has a handful of uploads */
+	for (uint32_t i = 0; i < tl->uploads; i++) {
+		for (uint32_t j = i + 1; j < tl->uploads; j++) {
+			if (hoist_overlap(&tl->upload[i], &tl->upload[j]))
+				tl->upload[i].hoisted = tl->upload[j].hoisted = false;
+		}
+	}
+}
+
+/*
+ * time on the wire of the upload (nsec): its own frames as they are
+ * (data written register by register among them), and every byte of
+ * its data blocks as encoded by spfm_encode_data()
+ */
+uint64_t hoist_stall(const struct timeline_t *tl, const struct tl_upload_t *upload)
+{
+	const uint8_t *frame = tl->frame + (size_t) upload->first * SPFM_FRAME_SIZE;
+	uint64_t frames = 0;
+
+	for (uint32_t i = 0; i < upload->count; i++, frame += SPFM_FRAME_SIZE) {
+		if (tl_upload_owns(upload, frame))
+			frames++;
+	}
+
+	for (uint32_t b = timeline_block_from(tl, upload->first);
+		b < tl->blocks && tl->block[b].frame < upload->first + upload->count; b++) {
+		if (tl->block[b].slot == upload->slot)
+			frames += (uint64_t) tl->block[b].size * (opt.fast_upload ? 1: 3);
+	}
+
+	return frames * SPFM_FRAME_SIZE * NSEC_PER_SEC / SPFM_LINK_RATE;
+}
+
+/* set the registers written by the preload back to 0 (see above) */
+void hoist_restore(int fd, const struct timeline_t *tl)
+{
+	bool written[SPFM_MAX_SLOT][SPFM_MAX_REG];
+	const struct tl_upload_t *upload;
+	const uint8_t *frame;
+
+	memset(written, 0, sizeof(written));
+
+	for (uint32_t i = 0; i < tl->uploads; i++) {
+		upload = &tl->upload[i];
+		if (!upload->hoisted || upload->slot >= SPFM_MAX_SLOT)
+			continue;
+
+		frame = tl->frame + (size_t) upload->first * SPFM_FRAME_SIZE;
+		for (uint32_t j = 0; j < upload->count; j++, frame += SPFM_FRAME_SIZE) {
+			if (tl_upload_owns(upload, frame))
+				written[upload->slot][frame[2]] = true;
+		}
+	}
+
+	for (uint8_t slot = 0; slot < SPFM_MAX_SLOT; slot++) {
+		for (int addr = 0; addr < SPFM_MAX_REG; addr++) {
+			if (written[slot][addr] && kf_state_reg(CHIP_OPNA, 0x01, addr))
+				spfm_send(fd, slot, 0x01, addr, 0x00);
+		}
+	}
+}
+
+/* send the hoisted uploads before the first event of the track */
+void hoist_preload(int fd, const struct timeline_t *tl)
+{
+	uint32_t count = 0;
+	uint64_t size = 0, start = now_nsec();
+
+	for (uint32_t i = 0; i < tl->uploads && catch_sigint == false; i++) {
+		if (!tl->upload[i].hoisted)
+			continue;
+		kf_send_upload(fd, tl, &tl->upload[i]);
+		size += tl->upload[i].size;
+		count++;
+	}
+
+	if (count > 0 && catch_sigint == false)
+		hoist_restore(fd, tl);
+	spfm_flush(fd);
+
+	if (count > 0)
+		logging(INFO, "hoist: %u upload(s), %.1f KB of ADPCM data sent before the start in %.3f sec\n",
+			count, (double) size / 1024, (double) (now_nsec() - start) / NSEC_PER_SEC);
+
+	for (uint32_t i = 0; i < tl->uploads; i++) {
+		if (tl->upload[i].hoisted)
+			continue;
+		logging(INFO, "hoist: upload at %.3f sec (slot %u, 0x%.4X-0x%.4X, %.1f KB) shares RAM "
+			"with another one: sent in place, stalls the track for about %.3f sec\n",
+			(double) tl->upload[i].time / NSEC_PER_SEC, tl->upload[i].slot,
+			tl->upload[i].start, tl->upload[i].stop, (double) tl->upload[i].size / 1024,
+			(double) hoist_stall(tl, &tl->upload[i]) / NSEC_PER_SEC);
+	}
+}
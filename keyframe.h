@@ -0,0 +1,309 @@
+/* See LICENSE for licence details. */
+/*
+	keyframe index (seek)
+
+	built in one pass over the compiled timeline: every KEYFRAME_INTERVAL
+	seconds the register state of every slot/port (the last value written
+	to each register that holds state, and the key on/off of every channel)
+	is stored with the group it applies to. ADPCM RAM uploads are recorded
+	as frame ranges, since the RAM content is not a register.
+
+	seeking to a position:
+		- replays the uploads begun before it, whole (and the hoisted
+		  ones): timeline_play() skips the data of one still going on
+		- takes the last keyframe at or before it and applies the groups
+		  between the keyframe and the position to a copy of its state
+		- writes that state to the chips (spfm_send())
+		- plays the timeline from the first group at the position
+	so the cost is bounded by the keyframe interval, not the track length
+*/
+
+enum keyframe_misc_t {
+	KEYFRAME_INTERVAL = 5,  /* sec */
+	KEYFRAME_CHANNELS = 8,  /* key on/off: channel number is (data & 0x07) */
+	KEYFRAME_INIT     = 64,
+	TL_UPLOAD_INIT    = 16,
+};
+
+struct kf_regs_t {
+	uint8_t value[SPFM_MAX_SLOT][SPFM_MAX_PORT][SPFM_MAX_REG];
+	uint8_t valid[SPFM_MAX_SLOT][SPFM_MAX_PORT][SPFM_MAX_REG];
+	uint8_t key[SPFM_MAX_SLOT][KEYFRAME_CHANNELS]; /* last key on/off write (0: off) */
+};
+
+struct keyframe_t {
+	uint64_t time;    /* time of the group (nsec) */
+	uint32_t group;   /* state before this group is played */
+	uint32_t reserved;
+	struct kf_regs_t regs;
+};
+
+/* key on/off register of the chip */
+bool kf_key_reg(enum chip_type_t chip, uint8_t port, uint8_t addr)
+{
+	return (chip == CHIP_OPM && addr == 0x08)
+		|| (chip == CHIP_OPNA && port == 0x00 && addr == 0x28);
+}
+
+bool kf_key_on(enum chip_type_t chip, uint8_t data)
+{
+	if (chip == CHIP_OPM)
+		return data & 0x78; /* slot mask */
+	else
+		return data & 0xF0; /* slot mask */
+}
+
+/* registers whose last value is chip state (see spfm_volatile_reg() for the rest) */
+bool kf_state_reg(enum chip_type_t chip, uint8_t port, uint8_t addr)
+{
+	if (chip == CHIP_OPM) {
+		return addr != 0x01      /* test, LFO reset */
+			&& addr != 0x14; /* timer control, flag reset, CSM */
+	} else if (chip == CHIP_OPNA) {
+		if (port == 0x00)
+			return addr != 0x10  /* rhythm key on/dump */
+				&& !(0x2D <= addr && addr <= 0x2F); /* prescaler (address only) */
+		else
+			return addr != 0x00  /* ADPCM start/record */
+				&& addr != 0x08  /* ADPCM data */
+				&& addr != 0x0E  /* DAC data */
+				&& addr != 0x0F; /* PCM data */
+	}
+	return true;
+}
+
+void kf_apply(struct kf_regs_t *regs, const uint8_t *chips, const uint8_t *frame)
+{
+	uint8_t slot = frame[0], port = frame[1] >> 1, addr = frame[2], data = frame[3];
+	enum chip_type_t chip;
+
+	if (slot >= SPFM_MAX_SLOT || port >= SPFM_MAX_PORT)
+		return;
+	chip = chips[slot];
+
+	if (kf_key_reg(chip, port, addr)) {
+		regs->key[slot][data & 0x07] = data;
+		return;
+	} else if (!kf_state_reg(chip, port, addr)) {
+		return;
+	}
+
+	if (chip == CHIP_OPM && addr == 0x19 && (data & 0x80))
+		port = 0x01; /* AMD/PMD share one address: OPM has no port 1, keep PMD there */
+	else if (chip == CHIP_OPNA && port == 0x00 && addr == 0x27)
+		data &= 0xC0; /* only the CH3 mode, not the timer control */
+
+	regs->value[slot][port][addr] = data;
+	regs->valid[slot][port][addr] = true;
+}
+
+bool kf_push_keyframe(struct timeline_t *tl, const struct kf_regs_t *regs, uint32_t group)
+{
+	struct keyframe_t *kf;
+
+	if (!timeline_grow((void **) &tl->keyframe, &tl->keyframe_cap, tl->keyframes,
+		sizeof(struct keyframe_t), KEYFRAME_INIT))
+		return false;
+
+	kf = &tl->keyframe[tl->keyframes++];
+	kf->time     = tl->group[group].time;
+	kf->group    = group;
+	kf->reserved = 0;
+	kf->regs     = *regs;
+	return true;
+}
+
+bool kf_push_upload(struct timeline_t *tl, uint64_t time, uint32_t first, uint32_t last, uint8_t slot)
+{
+	if (!timeline_grow((void **) &tl->upload, &tl->upload_cap, tl->uploads,
+		sizeof(struct tl_upload_t), TL_UPLOAD_INIT))
+		return false;
+
+	tl->upload[tl->uploads++] = (struct tl_upload_t){
+		.time = time, .first = first, .count = last - first + 1, .slot = slot };
+	return true;
+}
+
+/* ADPCM control 1 (port 1, 0x00) of OPNA: memory write is REC + MEMDATA without START */
+bool kf_upload_begin(const uint8_t *chips, const uint8_t *frame)
+{
+	return frame[0] < SPFM_MAX_SLOT && chips[frame[0]] == CHIP_OPNA
+		&& (frame[1] >> 1) == 0x01 && frame[2] == 0x00 && (frame[3] & 0xE0) == 0x60;
+}
+
+bool kf_upload_end(const uint8_t *frame, uint8_t slot)
+{
+	return frame[0] == slot && (frame[1] >> 1) == 0x01 && frame[2] == 0x00 && (frame[3] & 0xE0) != 0x60;
+}
+
+/* one pass over the timeline, false if out of memory (the timeline is still playable) */
+bool keyframe_build(struct timeline_t *tl)
+{
+	struct kf_regs_t regs;
+	const uint8_t *frame;
+	const struct tl_group_t *g;
+	uint64_t next = 0, start = now_nsec();
+	uint64_t upload_time = 0;
+	uint32_t upload_first = 0;
+	uint8_t upload_slot = 0;
+	bool uploading = false;
+
+	memset(&regs, 0, sizeof(struct kf_regs_t));
+
+	for (uint32_t i = 0; i < tl->groups; i++) {
+		g = &tl->group[i];
+
+		if (g->time >= next) {
+			if (!kf_push_keyframe(tl, &regs, i))
+				goto err;
+			next = (g->time / ((uint64_t) KEYFRAME_INTERVAL * NSEC_PER_SEC) + 1)
+				* KEYFRAME_INTERVAL * NSEC_PER_SEC;
+		}
+
+		frame = tl->frame + (size_t) g->first * SPFM_FRAME_SIZE;
+		for (uint32_t j = g->first; j < g->first + g->count; j++, frame += SPFM_FRAME_SIZE) {
+			if (!uploading && kf_upload_begin(tl->chip, frame)) {
+				uploading    = true;
+				upload_time  = g->time;
+				upload_first = j;
+				upload_slot  = frame[0];
+			} else if (uploading && kf_upload_end(frame, upload_slot)) {
+				uploading = false;
+				if (!kf_push_upload(tl, upload_time, upload_first, j, upload_slot))
+					goto err;
+			}
+			kf_apply(&regs, tl->chip, frame);
+		}
+	}
+
+	if (uploading && !kf_push_upload(tl, upload_time, upload_first, tl->frames - 1, upload_slot))
+		goto err;
+
+	logging(DEBUG, "keyframe: %u keyframe(s), %u upload(s), built in %.3f msec\n",
+		tl->keyframes, tl->uploads, (double) (now_nsec() - start) / NSEC_PER_MSEC);
+	return true;
+
+err:
+	logging(WARN, "couldn't allocate keyframe index: seeking is disabled\n");
+	free(tl->keyframe);
+	free(tl->upload);
+	tl->keyframe  = NULL;
+	tl->upload    = NULL;
+	tl->keyframes = tl->keyframe_cap = tl->uploads = tl->upload_cap = 0;
+	return false;
+}
+
+/* send an upload again: its own frames and data blocks, not what is written in between */
+void kf_send_upload(int fd, const struct timeline_t *tl, const struct tl_upload_t *upload)
+{
+	const uint8_t *frame = tl->frame + (size_t) upload->first * SPFM_FRAME_SIZE;
+	const struct tl_block_t *block;
+	uint32_t b = timeline_block_from(tl, upload->first);
+
+	for (uint32_t i = upload->first; i < upload->first + upload->count; i++, frame += SPFM_FRAME_SIZE) {
+		for (; b < tl->blocks && tl->block[b].frame == i; b++) {
+			block = &tl->block[b];
+			if (block->slot == upload->slot)
+				spfm_send_data(fd, block->slot, tl->data + block->offset, block->size, true);
+		}
+		if (tl_upload_owns(upload, frame))
+			spfm_send_frame(fd, frame);
+	}
+}
+
+/* write the register state: F-number high bytes before the low bytes latching them */
+int kf_restore(int fd, const struct kf_regs_t *regs)
+{
+	int count = 0;
+	uint8_t addr;
+
+	for (uint8_t slot = 0; slot < SPFM_MAX_SLOT; slot++) {
+		for (uint8_t port = 0; port < SPFM_MAX_PORT; port++) {
+			for (int i = 0; i < SPFM_MAX_REG; i++) {
+				addr = i;
+				if (spfm_chip[slot] == CHIP_OPNA && 0xA0 <= addr && addr <= 0xAF)
+					addr ^= 0x04; /* 0xA4-0xA6 before 0xA0-0xA2, 0xAC-0xAE before 0xA8-0xAA */
+
+				if (!regs->valid[slot][port][addr])
+					continue;
+
+				if (spfm_chip[slot] == CHIP_OPM && port == 0x01) /* PMD, see kf_apply() */
+					spfm_send(fd, slot, 0x00, addr, regs->value[slot][port][addr]);
+				else
+					spfm_send(fd, slot, port, addr, regs->value[slot][port][addr]);
+				count++;
+			}
+		}
+
+		for (int ch = 0; ch < KEYFRAME_CHANNELS; ch++) {
+			if (!kf_key_on(spfm_chip[slot], regs->key[slot][ch]))
+				continue;
+			spfm_send(fd, slot, 0x00, spfm_chip[slot] == CHIP_OPM ? 0x08: 0x28, regs->key[slot][ch]);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * bring the chips to their state at pos (nsec) and set the first group
+ * to play from there (tl->groups: nothing left). false without an index
+ */
+bool keyframe_seek(int fd, const struct timeline_t *tl, uint64_t pos, uint32_t *first)
+{
+	struct kf_regs_t regs;
+	const struct keyframe_t *kf;
+	const uint8_t *frame;
+	uint32_t lo, hi, mid, g, skipped, uploaded = 0;
+	uint64_t start = now_nsec();
+	int count;
+
+	if (tl->keyframes == 0) {
+		logging(WARN, "no keyframe index: playing from the beginning\n");
+		return false;
+	}
+
+	/* last keyframe at or before pos (keyframe[0] is at the first group) */
+	lo = 0;
+	hi = tl->keyframes;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (tl->keyframe[mid].time <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	kf   = &tl->keyframe[lo];
+	regs = kf->regs;
+
+	for (g = kf->group; g < tl->groups && tl->group[g].time < pos; g++) {
+		frame = tl->frame + (size_t) tl->group[g].first * SPFM_FRAME_SIZE;
+		for (uint32_t i = 0; i < tl->group[g].count; i++, frame += SPFM_FRAME_SIZE)
+			kf_apply(&regs, tl->chip, frame);
+	}
+	skipped = g - kf->group;
+
+	/* RAM first: uploads also set ADPCM addresses that the state overwrites */
+	for (uint32_t i = 0; i < tl->uploads && catch_sigint == false; i++) {
+		/*
+		 * hoisted ones belong before the start, wherever they were (see hoist.h).
+		 * one going on at pos is sent whole too: timeline_play() skips its rest
+		 */
+		if (tl->upload[i].time >= pos && !tl->upload[i].hoisted)
+			continue;
+		kf_send_upload(fd, tl, &tl->upload[i]);
+		uploaded++;
+	}
+
+	count = kf_restore(fd, &regs);
+	spfm_flush(fd);
+
+	logging(INFO, "seek: %.3f sec from the keyframe at %.3f sec (%u group(s) applied), "
+		"%d register(s) and %u upload(s) written in %.3f msec\n",
+		(double) pos / NSEC_PER_SEC, (double) kf->time / NSEC_PER_SEC, skipped,
+		count, uploaded, (double) (now_nsec() - start) / NSEC_PER_MSEC);
+
+	*first = g;
+	return true;
+}
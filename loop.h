@@ -0,0 +1,324 @@
+/* See LICENSE for licence details. */
+/*
+	playback event loop
+
+	signals are never delivered asynchronously: they are blocked in every
+	thread and read from a signalfd. the timing thread waits in epoll_wait()
+	on a timerfd (the next deadline), the signalfd and an eventfd used to
+	wake up every waiter at once when playback is stopped. the serial
+	writer (send_data()) waits on the tty, the signalfd and the same
+	eventfd, so a stop interrupts any wait, even a multi-megabyte upload.
+
+		SIGINT, SIGTERM : stop (catch_sigint) and quit
+		SIGTSTP, SIGUSR1: pause/resume
+
+	in daemon mode the control socket and its clients (control.h) are
+	served by the same epoll_wait(), so commands take effect while the
+	timing thread sleeps. during an upload it doesn't sleep: it serves
+	them between chunks of data (loop_serve()), and from the epoll fd
+	whenever it has to wait for the tty (loop_wait_writable())
+*/
+
+enum loop_misc_t {
+	LOOP_MAX_EVENTS = 16,
+};
+
+struct loop_t {
+	int epfd, tfd, sfd, efd;
+	pthread_t thread;          /* timing thread: the only one that serves control fds */
+	void (*control)(int fd);   /* called when a control fd is readable */
+	bool paused;
+	uint64_t pause_start; /* monotonic time of the last pause */
+	bool quit;      /* stopped by a signal, not by a command (see loop_clear_stop()) */
+	uint64_t shift; /* total time spent paused (nsec): every deadline moves by this */
+};
+
+struct loop_t loop = { .epfd = -1, .tfd = -1, .sfd = -1, .efd = -1 };
+
+/* must be called before any thread is created (the signal mask is inherited) */
+bool loop_init(void)
+{
+	sigset_t set;
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGTSTP);
+	sigaddset(&set, SIGUSR1);
+
+	loop.thread = pthread_self();
+
+	errno = 0;
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0
+		|| (loop.sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0
+		|| (loop.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0
+		|| (loop.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+		|| (loop.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto err;
+
+	ev.data.fd = loop.tfd;
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.tfd, &ev) < 0)
+		goto err;
+	ev.data.fd = loop.sfd;
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.sfd, &ev) < 0)
+		goto err;
+	ev.data.fd = loop.efd;
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.efd, &ev) < 0)
+		goto err;
+
+	return true;
+
+err:
+	logging(ERROR, "loop_init: %s\n", strerror(errno));
+	return false;
+}
+
+void loop_die(void)
+{
+	int *fds[] = { &loop.epfd, &loop.tfd, &loop.sfd, &loop.efd };
+
+	for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (*fds[i] != -1)
+			eclose(*fds[i]);
+		*fds[i] = -1;
+	}
+}
+
+/* wake up every waiter (the eventfd stays readable from now on) */
+void loop_stop(void)
+{
+	catch_sigint = true;
+
+	if (loop.efd != -1)
+		ewrite(loop.efd, &(uint64_t){1}, sizeof(uint64_t));
+}
+
+/* a command stopped the track, not the process: waits work again */
+void loop_clear_stop(void)
+{
+	uint64_t count;
+
+	catch_sigint = false;
+	(void) !read(loop.efd, &count, sizeof(count));
+}
+
+void loop_set_paused(bool paused)
+{
+	if (paused == loop.paused)
+		return;
+
+	if (paused)
+		loop.pause_start = now_nsec();
+	__atomic_store_n(&loop.paused, paused, __ATOMIC_RELEASE);
+	logging(INFO, "%s\n", paused ? "paused": "resumed");
+}
+
+/* serve fd (the control socket or a client) from loop_wait(): control(fd) when readable */
+bool loop_add_control(int fd, void (*control)(int fd))
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		logging(ERROR, "epoll_ctl: %s\n", strerror(errno));
+		return false;
+	}
+	loop.control = control;
+	return true;
+}
+
+/* read every pending signal (any thread may call this) */
+void loop_handle_signal(void)
+{
+	struct signalfd_siginfo info;
+
+	while (read(loop.sfd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGINT:
+		case SIGTERM:
+			logging(DEBUG, "caught signal %u: stop\n", info.ssi_signo);
+			loop.quit = true;
+			loop_stop();
+			break;
+		case SIGTSTP:
+		case SIGUSR1:
+			loop_set_paused(!loop.paused);
+			break;
+		}
+	}
+}
+
+/* serve the loop fds, waiting up to timeout (msec, -1: forever) for one */
+bool loop_dispatch(int timeout)
+{
+	int nfds;
+	uint64_t expirations;
+	struct epoll_event events[LOOP_MAX_EVENTS];
+
+	while ((nfds = epoll_wait(loop.epfd, events, LOOP_MAX_EVENTS, timeout)) < 0) {
+		if (errno != EINTR) {
+			logging(ERROR, "epoll_wait: %s\n", strerror(errno));
+			return false;
+		}
+	}
+
+	for (int i = 0; i < nfds; i++) {
+		if (events[i].data.fd == loop.sfd)
+			loop_handle_signal();
+		else if (events[i].data.fd == loop.tfd)
+			(void) !read(loop.tfd, &expirations, sizeof(expirations)); /* may be EAGAIN if re-armed */
+		else if (events[i].data.fd != loop.efd && loop.control)
+			loop.control(events[i].data.fd);
+	}
+
+	return catch_sigint == false;
+}
+
+/*
+ * wait on the loop fds until the timer fires or a signal is handled (true),
+ * or until playback is stopped (false). callers re-check their condition
+ */
+bool loop_wait(void)
+{
+	return loop_dispatch(-1);
+}
+
+/* handle pending signals without waiting (false if stopped) */
+bool loop_check(void)
+{
+	return loop_dispatch(0);
+}
+
+/* loop_check() from the timing thread, nothing from the others (they must not serve control fds) */
+void loop_serve(void)
+{
+	if (pthread_equal(pthread_self(), loop.thread))
+		loop_check();
+}
+
+/* arm the timerfd at an absolute monotonic time (0: disarm) */
+void loop_arm(uint64_t when)
+{
+	struct itimerspec its = {
+		.it_value = { .tv_sec = when / NSEC_PER_SEC, .tv_nsec = when % NSEC_PER_SEC },
+	};
+
+	if (timerfd_settime(loop.tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		logging(ERROR, "timerfd_settime: %s\n", strerror(errno));
+}
+
+/* block while paused; the time spent here shifts every following deadline */
+bool loop_pause(void)
+{
+	uint64_t start = now_nsec();
+
+	/* only a signal (resume/stop) or the stop eventfd can wake us up */
+	loop_arm(0);
+	while (__atomic_load_n(&loop.paused, __ATOMIC_ACQUIRE)) {
+		if (!loop_wait())
+			return false;
+	}
+	loop.shift += now_nsec() - start;
+
+	return true;
+}
+
+/*
+ * sleep until the absolute monotonic deadline (false if stopped)
+ *
+ * the kernel wakes us up somewhat late (timer slack, scheduling), which is
+ * a lot for 1-16 sample VGM waits (23-363 usec). so the timerfd is armed
+ * opt.spin usec before the deadline and we spin on the clock for the rest.
+ * the deadline already includes loop.shift (see loop_deadline()), a pause
+ * while we sleep moves it further
+ */
+bool sleep_until(uint64_t deadline)
+{
+	bool waited = false;
+	uint64_t now, late, shift, spin_start, spin = (uint64_t) opt.spin * NSEC_PER_USEC;
+
+	while (true) {
+		if (loop.paused) {
+			shift = loop.shift;
+			if (!loop_pause())
+				return false;
+			deadline += loop.shift - shift;
+		}
+
+		if ((now = now_nsec()) >= deadline) {
+			/* already late: nothing to wait for */
+			if (!waited)
+				return true;
+			break;
+		}
+		if (deadline - now <= spin)
+			break;
+
+		loop_arm(deadline - spin);
+		if (!loop_wait())
+			return false;
+		waited = true;
+	}
+
+	if (now < deadline) {
+		spin_start = now;
+		while ((now = now_nsec()) < deadline);
+		wakeup_stat.spin += now - spin_start;
+	}
+
+	late = now - deadline;
+	wakeup_stat.count++;
+	wakeup_stat.total += late;
+	if (late > wakeup_stat.max)
+		wakeup_stat.max = late;
+
+	return true;
+}
+
+/* a new track starts: pauses of the previous one don't move its deadlines */
+void loop_new_track(void)
+{
+	loop.shift = 0;
+}
+
+/* monotonic time at which position "time" of a track started at "origin" is due */
+uint64_t loop_deadline(uint64_t origin, uint64_t time)
+{
+	return origin + time + loop.shift;
+}
+
+/*
+ * wait until fd becomes writable (true), or until timeout (msec) or,
+ * if abortable, stop (false). safe to call from any thread
+ */
+bool loop_wait_writable(int fd, int timeout, bool abortable)
+{
+	int ret;
+	/* the timing thread keeps serving commands: the epoll fd has the signalfd too */
+	bool dispatch = abortable && loop.control && pthread_equal(pthread_self(), loop.thread);
+	struct pollfd pfd[3] = {
+		{ .fd = fd,       .events = POLLOUT },
+		{ .fd = dispatch ? loop.epfd: loop.sfd, .events = POLLIN },
+		{ .fd = loop.efd, .events = POLLIN  },
+	};
+
+	while (true) {
+		if ((ret = poll(pfd, abortable ? 3: 2, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logging(ERROR, "poll: %s\n", strerror(errno));
+			return false;
+		} else if (ret == 0) {
+			return false;
+		}
+
+		if ((pfd[1].revents & POLLIN) && dispatch)
+			loop_check();
+		else if (pfd[1].revents & POLLIN)
+			loop_handle_signal();
+		if (abortable && catch_sigint)
+			return false;
+		if (pfd[0].revents & (POLLOUT | POLLERR | POLLHUP))
+			return true;
+	}
+}
@@ -0,0 +1,164 @@
+/* See LICENSE for licence details. */
+enum event_type_t {
+	EVENT_WRITE = 0, /* register write */
+	EVENT_END,       /* end of track */
+	EVENT_LOOP,      /* loop point: the following events are repeated (no frame) */
+	EVENT_DATA,      /* piece of an ADPCM data block, valid only during emit() (decoder) */
+	EVENT_UPLOAD,    /* whole ADPCM data of an upload, kept in the timeline (timeline_play()) */
+	EVENT_CHIP,      /* chip of a slot, from the file header: frame[0] slot, frame[1] chip */
+};
+
+/* one register write as a ready-to-send wire frame, stamped with its position in the track */
+struct event_t {
+	uint64_t time; /* nsec from the beginning of the track */
+	uint8_t type;  /* enum event_type_t */
+	uint8_t frame[SPFM_FRAME_SIZE]; /* EVENT_DATA/EVENT_UPLOAD: frame[0] is the slot */
+	uint32_t count;       /* EVENT_DATA/EVENT_UPLOAD: bytes of ADPCM data */
+	const uint8_t *data;  /* EVENT_DATA/EVENT_UPLOAD: the data (not encoded) */
+};
+
+/*
+ * decoders (s98_decode(), vgm_decode()) don't touch the serial port:
+ * they advance out->time on every wait and hand each register write
+ * to out->emit(), which appends it to the timeline (see timeline.h).
+ * the timeline replay emits the same events again, which either are
+ * played right away (direct output) or queued to the pipeline
+ */
+struct output_t {
+	void (*emit)(struct output_t *out, const struct event_t *ev);
+	struct timebase_t tb; /* tick length of the format (set by the decoder) */
+	uint64_t ticks;       /* decoder position (ticks) */
+	uint64_t time;        /* decoder position (nsec), always ticks_to_nsec(ticks) */
+	int serial_fd;
+
+	/* direct output */
+	bool started;
+	uint64_t origin;      /* monotonic time of position 0 */
+	uint64_t played;      /* position of the last sent (or published) timing slot (nsec) */
+
+	void *arg;
+};
+
+void out_write(struct output_t *out, uint8_t slot, uint8_t port, uint8_t addr, uint8_t data)
+{
+	struct event_t ev = { .time = out->time, .type = EVENT_WRITE };
+
+	spfm_encode(ev.frame, slot, port, addr, data);
+	out->emit(out, &ev);
+}
+
+/* advance by ticks: the time is recomputed from the absolute position */
+void out_wait(struct output_t *out, uint64_t ticks)
+{
+	out->ticks += ticks;
+	out->time   = ticks_to_nsec(&out->tb, out->ticks);
+}
+
+void out_report_drift(uint64_t origin, uint64_t end)
+{
+	if (catch_sigint) {
+		wakeup_report();
+		return;
+	}
+
+	logging(INFO, "timing: track %.3f sec, drift %+.3f msec at the end\n",
+		(double) end / NSEC_PER_SEC, ((double) now_nsec() - loop_deadline(origin, end)) / NSEC_PER_MSEC);
+	wakeup_report();
+}
+
+/*
+ * the decoder says which chip plays on the slot. it doesn't touch
+ * spfm_chip itself: a track may be compiled while another one plays
+ */
+void out_chip(struct output_t *out, uint8_t slot, enum chip_type_t chip)
+{
+	struct event_t ev = { .time = out->time, .type = EVENT_CHIP };
+
+	ev.frame[0] = slot;
+	ev.frame[1] = chip;
+	out->emit(out, &ev);
+}
+
+/*
+ * ADPCM data for the data port of the slot (after the upload registers).
+ * not encoded to frames here: the timeline keeps it as it is and the
+ * data is encoded while it is sent (see spfm_send_data())
+ */
+void out_data(struct output_t *out, uint8_t slot, const uint8_t *data, uint32_t size)
+{
+	struct event_t ev = { .time = out->time, .type = EVENT_DATA, .count = size, .data = data };
+
+	ev.frame[0] = slot;
+	out->emit(out, &ev);
+}
+
+/* mark the loop point of the track at the current position */
+void out_loop(struct output_t *out)
+{
+	struct event_t ev = { .time = out->time, .type = EVENT_LOOP };
+
+	out->emit(out, &ev);
+}
+
+void out_end(struct output_t *out)
+{
+	struct event_t ev = { .time = out->time, .type = EVENT_END };
+
+	out->emit(out, &ev);
+}
+
+/*
+ * direct output: decode, sleep and send on the calling thread.
+ * every event is due at origin + ev->time, so time spent decoding
+ * and writing is absorbed instead of adding up
+ */
+void direct_emit(struct output_t *out, const struct event_t *ev)
+{
+	if (ev->type == EVENT_LOOP) { /* only meaningful to the timeline */
+		return;
+	} else if (ev->type == EVENT_CHIP) {
+		spfm_set_chip(ev->frame[0], ev->frame[1]);
+		return;
+	}
+
+	if (!out->started) {
+		out->origin  = now_nsec();
+		out->started = true;
+		spfm_set_due(loop_deadline(out->origin, 0));
+	}
+
+	if (ev->time > out->played) {
+		/* everything queued before this wait shares one timing slot */
+		spfm_flush(out->serial_fd);
+		if (!sleep_until(loop_deadline(out->origin, ev->time)))
+			return;
+		out->played = ev->time;
+		spfm_set_due(loop_deadline(out->origin, ev->time));
+	}
+
+	if (catch_sigint)
+		return;
+
+	if (ev->type == EVENT_WRITE) {
+		spfm_send_frame(out->serial_fd, ev->frame);
+	} else if (ev->type == EVENT_DATA || ev->type == EVENT_UPLOAD) {
+		spfm_send_data(out->serial_fd, ev->frame[0], ev->data, ev->count, ev->type == EVENT_UPLOAD);
+	} else {
+		spfm_flush(out->serial_fd);
+		out_report_drift(out->origin, ev->time);
+	}
+}
+
+/* origin: monotonic time of position 0, or 0 to start the clock at the first event */
+void direct_init(struct output_t *out, int serial_fd, uint64_t origin)
+{
+	memset(out, 0, sizeof(struct output_t));
+	out->emit      = direct_emit;
+	out->serial_fd = serial_fd;
+
+	if (origin != 0) {
+		out->origin  = origin;
+		out->started = true;
+		spfm_set_due(loop_deadline(origin, 0));
+	}
+}
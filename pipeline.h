@@ -0,0 +1,395 @@
+/* See LICENSE for licence details. */
+/*
+	pipeline mode:
+
+		[decoder thread] --(decoded ring)--> [scheduler] --(released ring)--> [transmit thread]
+
+		decoder  : replays the compiled timeline (or decodes a stream) as far ahead
+		           as the decoded ring allows
+		scheduler: owns the clock (main thread), releases events when they are due
+		transmit : owns serial_fd, batches every released event into one write
+
+	both rings are bounded single-producer/single-consumer lock-free queues.
+	a semaphore is only touched when one side actually has to sleep.
+*/
+
+enum pipeline_misc_t {
+	RING_SIZE      = 4096, /* events, must be power of 2 */
+	RING_BATCH     = RING_SIZE / 4, /* decoder publishes at least every RING_BATCH events */
+	CACHE_LINE     = 64,
+	PIPELINE_SIGNAL_POLL = 20, /* msec: a blocked scheduler checks signals (and commands) this often */
+};
+
+struct ring_t {
+	struct event_t buf[RING_SIZE];
+
+	/* producer side: events up to head are visible, up to next are staged */
+	uint32_t head, next;
+	char pad0[CACHE_LINE - 2 * sizeof(uint32_t)];
+
+	/* consumer side */
+	uint32_t tail;
+	char pad1[CACHE_LINE - sizeof(uint32_t)];
+
+	bool data_waiting, space_waiting;
+	sem_t data, space;
+};
+
+struct pipeline_t {
+	struct ring_t decoded;  /* decoder   -> scheduler */
+	struct ring_t released; /* scheduler -> transmit  */
+
+	struct track_t *track;
+	int serial_fd;
+	bool stop;
+	uint64_t origin; /* monotonic time of position 0 (set before the first release) */
+
+	/* statistics */
+	uint64_t underruns;   /* events that became due while the decoded ring was empty */
+	uint32_t max_backlog; /* deepest released ring seen by the scheduler */
+};
+
+/* ring functions */
+bool ring_init(struct ring_t *r)
+{
+	r->head = r->next = r->tail = 0;
+	r->data_waiting = r->space_waiting = false;
+
+	if (sem_init(&r->data, 0, 0) < 0 || sem_init(&r->space, 0, 0) < 0) {
+		logging(ERROR, "sem_init: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void ring_die(struct ring_t *r)
+{
+	sem_destroy(&r->data);
+	sem_destroy(&r->space);
+}
+
+uint32_t ring_count(struct ring_t *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* producer only: stage one event, invisible to the consumer until ring_commit() */
+bool ring_put(struct ring_t *r, const struct event_t *ev)
+{
+	if (r->next - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+		return false;
+
+	r->buf[r->next & (RING_SIZE - 1)] = *ev;
+	r->next++;
+
+	return true;
+}
+
+/* producer only: publish every staged event at once */
+void ring_commit(struct ring_t *r)
+{
+	if (r->head == r->next)
+		return;
+
+	__atomic_store_n(&r->head, r->next, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&r->data_waiting, false, __ATOMIC_SEQ_CST))
+		sem_post(&r->data);
+}
+
+bool ring_push(struct ring_t *r, const struct event_t *ev)
+{
+	if (!ring_put(r, ev))
+		return false;
+
+	ring_commit(r);
+	return true;
+}
+
+/* consumer only */
+bool ring_pop(struct ring_t *r, struct event_t *ev)
+{
+	uint32_t tail = r->tail;
+
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+		return false;
+
+	*ev = r->buf[tail & (RING_SIZE - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&r->space_waiting, false, __ATOMIC_SEQ_CST))
+		sem_post(&r->space);
+
+	return true;
+}
+
+/* sem_wait() for at most msec (-1: no limit) */
+void ring_sem_wait(sem_t *sem, int msec)
+{
+	struct timespec ts;
+	uint64_t deadline;
+
+	if (msec < 0) {
+		sem_wait(sem);
+		return;
+	}
+
+	/* sem_timedwait() only takes CLOCK_REALTIME: a clock step just shortens or stretches one wait */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	deadline   = (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec + (uint64_t) msec * NSEC_PER_MSEC;
+	ts.tv_sec  = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+	while (sem_timedwait(sem, &ts) < 0 && errno == EINTR);
+}
+
+/* sleep until the ring has something to pop, msec at most (may return spuriously, e.g. on signal) */
+void ring_wait_data(struct ring_t *r, int msec)
+{
+	__atomic_store_n(&r->data_waiting, true, __ATOMIC_SEQ_CST);
+	if (ring_count(r) == 0)
+		ring_sem_wait(&r->data, msec);
+	__atomic_store_n(&r->data_waiting, false, __ATOMIC_SEQ_CST);
+}
+
+/* sleep until the ring has room to push, msec at most (may return spuriously, e.g. on signal) */
+void ring_wait_space(struct ring_t *r, int msec)
+{
+	__atomic_store_n(&r->space_waiting, true, __ATOMIC_SEQ_CST);
+	if (ring_count(r) == RING_SIZE)
+		ring_sem_wait(&r->space, msec);
+	__atomic_store_n(&r->space_waiting, false, __ATOMIC_SEQ_CST);
+}
+
+/* wake both sides of the ring whatever they are waiting for */
+void ring_kick(struct ring_t *r)
+{
+	sem_post(&r->data);
+	sem_post(&r->space);
+}
+
+/* pipeline functions */
+bool pipeline_stopped(struct pipeline_t *pipe)
+{
+	return __atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE);
+}
+
+void pipeline_emit(struct output_t *out, const struct event_t *ev);
+
+/*
+ * a piece of a streamed data block is gone once emit() returns: it goes
+ * through the ring as encoded writes, so the decoder reads on only as
+ * far ahead as the ring allows while the transmitter sends
+ */
+void pipeline_emit_data(struct output_t *out, const struct event_t *ev)
+{
+	struct event_t write = { .time = ev->time, .type = EVENT_WRITE };
+	uint8_t frame[3 * SPFM_FRAME_SIZE];
+	int frames;
+
+	for (uint32_t i = 0; i < ev->count; i++) {
+		frames = spfm_encode_data(frame, ev->frame[0], ev->data[i]);
+		for (int j = 0; j < frames; j++) {
+			memcpy(write.frame, frame + j * SPFM_FRAME_SIZE, SPFM_FRAME_SIZE);
+			pipeline_emit(out, &write);
+		}
+	}
+}
+
+/*
+ * the decoder publishes whole timing slots (or RING_BATCH events of a
+ * huge one), so that the scheduler isn't woken up for every event
+ */
+void pipeline_emit(struct output_t *out, const struct event_t *ev)
+{
+	struct pipeline_t *pipe = (struct pipeline_t *) out->arg;
+	struct ring_t *r = &pipe->decoded;
+
+	if (ev->type == EVENT_LOOP) { /* only meaningful to the timeline */
+		return;
+	} else if (ev->type == EVENT_DATA) {
+		pipeline_emit_data(out, ev);
+		return;
+	}
+
+	if (ev->time != out->played || r->next - r->head >= RING_BATCH) {
+		ring_commit(r);
+		out->played = ev->time;
+	}
+
+	while (!ring_put(r, ev)) {
+		ring_commit(r);
+		if (pipeline_stopped(pipe))
+			return;
+		ring_wait_space(r, -1);
+	}
+
+	if (ev->type == EVENT_END)
+		ring_commit(r);
+}
+
+void *pipeline_decoder(void *arg)
+{
+	struct pipeline_t *pipe = (struct pipeline_t *) arg;
+	struct output_t out;
+
+	/* the decoder runs ahead: it doesn't need (and mustn't hog) real-time priority */
+	if (opt.realtime)
+		rt_leave();
+
+	memset(&out, 0, sizeof(struct output_t));
+	out.emit = pipeline_emit;
+	out.arg  = pipe;
+
+	/* always terminates the stream with EVENT_END */
+	track_play(&out, pipe->track);
+
+	return NULL;
+}
+
+void *pipeline_transmitter(void *arg)
+{
+	struct pipeline_t *pipe = (struct pipeline_t *) arg;
+	struct event_t ev;
+
+	if (opt.realtime)
+		rt_enter(opt.cpu);
+
+	while (true) {
+		if (catch_sigint)
+			break;
+
+		if (!ring_pop(&pipe->released, &ev)) {
+			/* nothing more is due right now: send the whole timing slot at once */
+			spfm_flush(pipe->serial_fd);
+			if (pipeline_stopped(pipe))
+				break;
+			ring_wait_data(&pipe->released, -1);
+			continue;
+		}
+
+		if (ev.type == EVENT_END) {
+			spfm_flush(pipe->serial_fd);
+			break;
+		}
+		spfm_set_due(loop_deadline(pipe->origin, ev.time));
+		if (ev.type == EVENT_UPLOAD)
+			spfm_send_data(pipe->serial_fd, ev.frame[0], ev.data, ev.count, true);
+		else if (ev.type == EVENT_CHIP) /* in order with the frames it applies to */
+			spfm_set_chip(ev.frame[0], ev.frame[1]);
+		else
+			spfm_send_frame(pipe->serial_fd, ev.frame);
+	}
+
+	/* stopped: the scheduler may be waiting for space that will never be freed */
+	ring_kick(&pipe->released);
+	return NULL;
+}
+
+/* stage a due event; the whole timing slot is committed in one go */
+void pipeline_release(struct pipeline_t *pipe, const struct event_t *ev)
+{
+	uint32_t backlog;
+
+	while (!ring_put(&pipe->released, ev)) {
+		/* slot larger than the ring (e.g. ADPCM upload): let it drain */
+		ring_commit(&pipe->released);
+		if (catch_sigint)
+			return;
+		/* the transmitter may be busy for seconds: keep serving signals and commands */
+		ring_wait_space(&pipe->released, PIPELINE_SIGNAL_POLL);
+		loop_check();
+	}
+
+	if ((backlog = pipe->released.next - pipe->released.tail) > pipe->max_backlog)
+		pipe->max_backlog = backlog;
+}
+
+void pipeline_schedule(struct pipeline_t *pipe)
+{
+	struct event_t ev;
+	uint64_t origin = 0, released = 0;
+	bool started = false, starved = false;
+
+	while (catch_sigint == false) {
+		if (!ring_pop(&pipe->decoded, &ev)) {
+			ring_commit(&pipe->released);
+			/* the decoder may be stuck (e.g. on a slow read): signals are only read here */
+			ring_wait_data(&pipe->decoded, PIPELINE_SIGNAL_POLL);
+			loop_check();
+			starved = started;
+			continue;
+		}
+
+		if (!started) {
+			origin  = pipe->origin = (pipe->track->origin != 0) ? pipe->track->origin: now_nsec();
+			started = true;
+		}
+
+		if (starved && origin + ev.time < now_nsec())
+			pipe->underruns++;
+		starved = false;
+
+		if (ev.time > released) {
+			ring_commit(&pipe->released);
+			if (!sleep_until(loop_deadline(origin, ev.time)))
+				break;
+			released = ev.time;
+		}
+
+		pipeline_release(pipe, &ev);
+
+		if (ev.type == EVENT_END) {
+			ring_commit(&pipe->released);
+			pipe->track->finish = loop_deadline(origin, ev.time);
+			out_report_drift(origin, ev.time);
+			return;
+		}
+	}
+	ring_commit(&pipe->released);
+
+	if (catch_sigint)
+		logging(DEBUG, "caught SIGINT\n");
+}
+
+bool pipeline_play(int serial_fd, struct track_t *track)
+{
+	static struct pipeline_t pipe;
+	pthread_t decoder, transmitter;
+	bool ret = false;
+	int err;
+
+	memset(&pipe, 0, sizeof(struct pipeline_t));
+	pipe.track     = track;
+	pipe.serial_fd = serial_fd;
+
+	if (!ring_init(&pipe.decoded) || !ring_init(&pipe.released))
+		return false;
+
+	/* signals are blocked in every thread and read by the scheduler (see loop.h) */
+	if ((err = pthread_create(&decoder, NULL, pipeline_decoder, &pipe)) != 0) {
+		logging(ERROR, "pthread_create: %s\n", strerror(err));
+		goto err_decoder;
+	}
+	if ((err = pthread_create(&transmitter, NULL, pipeline_transmitter, &pipe)) != 0) {
+		logging(ERROR, "pthread_create: %s\n", strerror(err));
+		goto err_transmitter;
+	}
+	pipeline_schedule(&pipe);
+	ret = true;
+
+	__atomic_store_n(&pipe.stop, true, __ATOMIC_RELEASE);
+	ring_kick(&pipe.released);
+	pthread_join(transmitter, NULL);
+err_transmitter:
+	__atomic_store_n(&pipe.stop, true, __ATOMIC_RELEASE);
+	ring_kick(&pipe.decoded);
+	pthread_join(decoder, NULL);
+err_decoder:
+	ring_die(&pipe.decoded);
+	ring_die(&pipe.released);
+
+	logging(INFO, "pipeline: %llu decoder underrun(s), max transmit backlog %u event(s)\n",
+		(unsigned long long) pipe.underruns, pipe.max_backlog);
+
+	return ret;
+}
@@ -19,48 +19,186 @@ const char *filetype2str[] = {
 };
 
 /* VGM/S98 common loader functions */
-enum filetype_t check_filetype(FILE *fp)
+
+/*
+ * map the whole input file read-only: the parsers decode it in place.
+ * in real-time mode every page is read in now (MAP_POPULATE) and stays
+ * resident (mlockall), so playing never faults on the input
+ */
+bool input_map(const char *path, struct cursor_t *cur)
 {
-	uint8_t header[MAGIC_NUMBER_SIZE];
-	size_t size;
+	int fd;
+	struct stat st;
+	void *map;
 
-	if ((size = efread(header, 1, MAGIC_NUMBER_SIZE, fp)) != MAGIC_NUMBER_SIZE)
-		return FILETYPE_UNKNOWN;
+	if ((fd = eopen(path, O_RDONLY)) < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0) {
+		logging(ERROR, "fstat: %s\n", strerror(errno));
+		eclose(fd);
+		return false;
+	} else if (st.st_size == 0) {
+		logging(ERROR, "\"%s\" is empty\n", path);
+		eclose(fd);
+		return false;
+	}
 
-	efseek(fp, 0L, SEEK_SET);
+	map = emmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | (opt.realtime ? MAP_POPULATE: 0), fd, 0);
+	eclose(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	if (!opt.realtime)
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	cursor_init(cur, map, st.st_size);
+	return true;
+}
 
-	if (memcmp(header, s98_header, MAGIC_NUMBER_SIZE) == 0)
+void input_unmap(struct cursor_t *cur)
+{
+	emunmap((void *) cur->buf, cur->size);
+	cursor_init(cur, NULL, 0);
+}
+
+enum filetype_t check_filetype(struct cursor_t *cur)
+{
+	if (!cursor_avail(cur, MAGIC_NUMBER_SIZE))
+		return FILETYPE_UNKNOWN;
+
+	if (memcmp(cur->buf + cur->pos, s98_header, MAGIC_NUMBER_SIZE) == 0)
 		return FILETYPE_S98;
-	else if (memcmp(header, vgm_header, MAGIC_NUMBER_SIZE) == 0)
+	else if (memcmp(cur->buf + cur->pos, vgm_header, MAGIC_NUMBER_SIZE) == 0)
 		return FILETYPE_VGM;
 	else
 		return FILETYPE_UNKNOWN;
 }
 
-bool play_file(int serial_fd, const char *path)
+/* compile the mapped input (or map the cached timeline), then unmap the input */
+bool track_compile(struct track_t *track)
+{
+	struct cursor_t *input = &track->input;
+	uint64_t hash = 0;
+	bool ret = true;
+
+	/* warm start: play the cached timeline, nothing to parse */
+	if (!opt.nocache) {
+		hash = fnv1a(fnv_offset_basis, input->buf, input->size);
+		/* -m changes the compiled frames */
+		hash = fnv1a(hash, (const uint8_t *) opt.route, opt.routes * sizeof(int));
+		logging(DEBUG, "hash:%.16llX\n", (unsigned long long) hash);
+	}
+
+	if (opt.nocache || !cache_load(&track->tl, hash, input->size)) {
+		if (!timeline_compile(&track->tl, input, track->decode)) {
+			ret = false;
+		} else if (keyframe_build(&track->tl)) {
+			hoist_plan(&track->tl);
+			/* a stop while compiling (e.g. in the background) leaves it incomplete */
+			if (!opt.nocache && !catch_sigint)
+				cache_store(&track->tl, hash, input->size);
+		}
+	}
+
+	/* the timeline doesn't refer to the input */
+	input_unmap(input);
+	return ret;
+}
+
+/*
+ * get the track ready to play: compile it (or load it from the cache),
+ * or open the gzip stream. nothing is sent and no global state of the
+ * player is touched, so this may run while another track plays
+ */
+bool track_open(struct track_t *track, const char *path)
 {
-	FILE *input_fp;
 	enum filetype_t type;
 
-	if ((input_fp = efopen(path, "r")) == NULL)
+	memset(track, 0, sizeof(struct track_t));
+
+	if (!input_map(path, &track->input))
 		return false;
-	
-	type = check_filetype(input_fp);
-	logging(DEBUG, "filetype:%s\n", filetype2str[type]);
+
+	/* gzip: decode while inflating through a fixed window (never held in memory) */
+	if (vgz_is_gzip(&track->input)) {
+		input_unmap(&track->input);
+		if (!vgz_open(&track->vgz, path, &track->input))
+			return false;
+		track->streamed = true;
+		if (opt.loops > 0)
+			logging(WARN, "gzipped input is played once (-l needs a compiled timeline)\n");
+	}
+
+	type = check_filetype(&track->input);
+	logging(DEBUG, "filetype:%s%s\n", filetype2str[type], track->streamed ? " (gzip)": "");
 
 	switch (type) {
 	case FILETYPE_S98:
-		s98_play(serial_fd, input_fp);
+		track->decode = s98_decode;
 		break;
 	case FILETYPE_VGM:
-		vgm_play(serial_fd, input_fp);
+		track->decode = vgm_decode;
 		break;
 	default:
 		logging(ERROR, "unknown filetype\n");
-		efclose(input_fp);
+		if (track->streamed)
+			vgz_close(&track->vgz, &track->input);
+		else
+			input_unmap(&track->input);
 		return false;
 	}
 
-	efclose(input_fp);
-	return true;
+	return track->streamed || track_compile(track);
+}
+
+void track_close(struct track_t *track)
+{
+	if (track->streamed)
+		vgz_close(&track->vgz, &track->input);
+	else
+		timeline_die(&track->tl);
+}
+
+/* set the chips up for the track: chip types, then seek to start (nsec) or preload the RAM */
+void track_start(int serial_fd, struct track_t *track, uint64_t start)
+{
+	loop_new_track();
+	spfm_stat_reset();
+
+	if (track->streamed) {
+		/* the decoder sets the chips (EVENT_CHIP) */
+		if (start > 0)
+			logging(WARN, "gzipped input is played from the beginning (-t needs a compiled timeline)\n");
+		return;
+	}
+
+	for (int slot = 0; slot < SPFM_MAX_SLOT; slot++)
+		spfm_set_chip(slot, track->tl.chip[slot]);
+
+	if (start > 0) {
+		track->start = (start < track->tl.end) ? start: track->tl.end;
+		if (!keyframe_seek(serial_fd, &track->tl, track->start, &track->first))
+			track->start = 0;
+	} else {
+		hoist_preload(serial_fd, &track->tl);
+	}
+}
+
+/* play the track from track->origin (0: now) and set track->finish */
+void track_output(int serial_fd, struct track_t *track)
+{
+	struct output_t out;
+
+	if (opt.pipeline) {
+		pipeline_play(serial_fd, track);
+	} else {
+		direct_init(&out, serial_fd, track->origin);
+		track_play(&out, track);
+		track->finish = loop_deadline(out.origin, out.played);
+	}
+
+	spfm_flush(serial_fd);
+	spfm_report();
 }
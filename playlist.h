@@ -0,0 +1,131 @@
+/* See LICENSE for licence details. */
+/*
+	playlist: every FILE in one serial session
+
+	while a track plays, the next one is opened on a background thread
+	(track_open(): compiled or loaded from the cache, never sent), so at
+	the end of the track there is nothing left to parse. the next track
+	starts at the monotonic time the previous one ended: the time base
+	goes on, and the first event of the next track is due exactly at the
+	end of the previous one. work that has to be sent before it starts
+	(ADPCM preload, seek) can push it back: the gap is reported
+*/
+
+enum playlist_misc_t {
+	PLAYLIST_MAX_LATE = 10 * NSEC_PER_MSEC, /* switch later than this: restart the clock */
+};
+
+struct playlist_t {
+	struct track_t track[2]; /* playing, and the next one being prepared */
+
+	/* background preparation */
+	pthread_t thread;
+	const char *path;
+	int next;        /* index in track[] */
+	bool ready;      /* track_open() succeeded */
+	bool done;       /* the thread is over (ready is set) */
+	uint64_t nsec;   /* time it took */
+};
+
+void *playlist_prepare(void *arg)
+{
+	struct playlist_t *list = (struct playlist_t *) arg;
+	uint64_t start = now_nsec();
+
+	/* the next track must not compete with the one playing */
+	if (opt.realtime)
+		rt_leave();
+
+	list->ready = track_open(&list->track[list->next], list->path);
+	list->nsec  = now_nsec() - start;
+	__atomic_store_n(&list->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* open the track in the background, false if it has to be done in the foreground */
+bool playlist_prepare_start(struct playlist_t *list, int next, const char *path)
+{
+	int err;
+
+	list->next  = next;
+	list->path  = path;
+	list->ready = false;
+	list->done  = false;
+
+	if ((err = pthread_create(&list->thread, NULL, playlist_prepare, list)) != 0) {
+		logging(WARN, "pthread_create: %s (the next track is prepared after this one)\n", strerror(err));
+		return false;
+	}
+	return true;
+}
+
+/* gapless: position 0 of the track is the end of the previous one (finish, 0: none) */
+void playlist_chain(struct track_t *track, uint64_t finish, const char *path)
+{
+	uint64_t now = now_nsec();
+
+	if (finish != 0 && now <= finish + PLAYLIST_MAX_LATE) {
+		track->origin = finish;
+	} else if (finish != 0) {
+		logging(INFO, "playlist: \"%s\" starts %.3f msec after the previous track\n",
+			path, (double) (now - finish) / NSEC_PER_MSEC);
+	}
+}
+
+bool playlist_play(int serial_fd, char **path, int count)
+{
+	static struct playlist_t list;
+	struct track_t *track;
+	uint64_t finish = 0;
+	bool ret = true, ready, background = false;
+	int cur = 0;
+
+	memset(&list, 0, sizeof(struct playlist_t));
+	ready = track_open(&list.track[cur], path[0]);
+
+	for (int i = 0; i < count; i++) {
+		track = &list.track[cur];
+
+		if (catch_sigint) {
+			if (ready)
+				track_close(track);
+			break;
+		}
+
+		if (i + 1 < count)
+			background = playlist_prepare_start(&list, !cur, path[i + 1]);
+
+		if (!ready) {
+			logging(WARN, "couldn't open \"%s\"\n", path[i]);
+			ret = false;
+		} else {
+			if (i > 0)
+				spfm_silence(serial_fd);
+			track_start(serial_fd, track, (i == 0) ? opt.start: 0);
+			playlist_chain(track, finish, path[i]);
+			track_output(serial_fd, track);
+			finish = track->finish;
+			track_close(track);
+		}
+
+		if (i + 1 >= count)
+			break;
+
+		cur = !cur;
+		if (background) {
+			pthread_join(list.thread, NULL);
+			ready = list.ready;
+			logging(INFO, "playlist: \"%s\" prepared in the background in %.3f msec\n",
+				path[i + 1], (double) list.nsec / NSEC_PER_MSEC);
+		} else {
+			ready = track_open(&list.track[cur], path[i + 1]);
+		}
+		background = false;
+
+		/* nothing was played: don't chain to an old end */
+		if (!ready)
+			finish = 0;
+	}
+
+	return ret;
+}
@@ -0,0 +1,73 @@
+/* See LICENSE for licence details. */
+/*
+	real-time mode (-r, -c CPU):
+
+		- lock every current and future page (no page fault while playing)
+		- read the whole input file in when it is mapped (MAP_POPULATE, see
+		  input_map()); it is unmapped once the timeline is compiled
+		- run the timing thread (and the transmit thread in pipeline mode)
+		  with SCHED_FIFO, optionally pinned to one CPU
+
+	each step falls back to normal operation with a warning when the
+	privilege (CAP_SYS_NICE, CAP_IPC_LOCK or RLIMIT_*) is missing.
+*/
+
+enum rt_misc_t {
+	RT_PRIORITY      = 80,        /* SCHED_FIFO priority */
+	RT_STACK_PREFAULT = 64 * 1024, /* bytes of stack touched in advance */
+};
+
+/* affinity before pinning, given back to non real-time threads */
+cpu_set_t rt_default_cpus;
+bool rt_pinned = false;
+
+void rt_lock_memory(void)
+{
+	errno = 0;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		logging(WARN, "mlockall: %s (memory is not locked)\n", strerror(errno));
+}
+
+/* grow the stack now, so that it never page faults while playing */
+void rt_prefault_stack(void)
+{
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+
+	memset((uint8_t *) stack, 0, RT_STACK_PREFAULT);
+}
+
+/* make the calling thread real-time (and pin it if cpu >= 0) */
+void rt_enter(int cpu)
+{
+	int err;
+	cpu_set_t set;
+	struct sched_param param = { .sched_priority = RT_PRIORITY };
+
+	if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+		logging(WARN, "pthread_setschedparam: %s (running without real-time priority)\n", strerror(err));
+
+	if (cpu >= 0) {
+		if (!rt_pinned)
+			pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &rt_default_cpus);
+		rt_pinned = true;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set)) != 0)
+			logging(WARN, "pthread_setaffinity_np: %s (not pinned to cpu %d)\n", strerror(err), cpu);
+	}
+
+	rt_prefault_stack();
+}
+
+/* threads created by a real-time thread inherit its policy: undo it */
+void rt_leave(void)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+	if (rt_pinned)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &rt_default_cpus);
+}
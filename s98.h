@@ -99,30 +99,32 @@ struct s98_header_t {
 	struct s98_device_t device[S98_MAX_DEVICE];
 };
 
-bool s98_parse_header(FILE *fp, struct s98_header_t *header)
+bool s98_parse_header(struct cursor_t *cur, struct s98_header_t *header)
 {
-	uint8_t buf[BUFSIZE];
+	const uint8_t *magic;
 	char tag[S98_TAGSIZE];
 
 	/* read common header */
-	if (fread(buf, 1, 4, fp) != 4
-		|| strncmp((char *) buf, "S98", 3)   != 0) {
-		logging(ERROR, "magic number miss match: %c %c %c %c\n",
-			buf[0], buf[1], buf[2], buf[3]);
+	if ((magic = cursor_take(cur, 4)) == NULL
+		|| strncmp((char *) magic, "S98", 3) != 0) {
+		if (magic)
+			logging(ERROR, "magic number miss match: %c %c %c %c\n",
+				magic[0], magic[1], magic[2], magic[3]);
 		return false;
 	}
 	logging(DEBUG, "magic number: '%c '%c' '%c' '%c'\n",
-		buf[0], buf[1], buf[2], buf[3]);
-
-	header->version = buf[3] - '0';
-
-	if (read_4byte_le(fp, &header->numerator)       != 4
-		|| read_4byte_le(fp, &header->denominator)  != 4
-		|| read_4byte_le(fp, &header->compressing)  != 4
-		|| read_4byte_le(fp, &header->offset_tag)   != 4
-		|| read_4byte_le(fp, &header->offset_dump)  != 4
-		|| read_4byte_le(fp, &header->offset_loop)  != 4
-		|| read_4byte_le(fp, &header->device_count) != 4)
+		magic[0], magic[1], magic[2], magic[3]);
+
+	header->version = magic[3] - '0';
+
+	header->numerator    = cursor_u32le(cur);
+	header->denominator  = cursor_u32le(cur);
+	header->compressing  = cursor_u32le(cur);
+	header->offset_tag   = cursor_u32le(cur);
+	header->offset_dump  = cursor_u32le(cur);
+	header->offset_loop  = cursor_u32le(cur);
+	header->device_count = cursor_u32le(cur);
+	if (cur->overrun)
 		return false;
 
 	logging(DEBUG, "S98 header:\n"
@@ -139,13 +141,18 @@ bool s98_parse_header(FILE *fp, struct s98_header_t *header)
 		header->offset_loop, header->device_count);
 
 	/* read device info */
-	if (header->version == 3 && header->device_count > 0) {
+	if (header->version == 3 && header->device_count > S98_MAX_DEVICE) {
+		logging(ERROR, "too many devices: %u (max %d)\n", header->device_count, S98_MAX_DEVICE);
+		return false;
+	} else if (header->version == 3 && header->device_count > 0) {
 		for (unsigned int i = 0; i < header->device_count; i++) {
-			if (read_4byte_le(fp, &header->device[i].type)     != 4
-				|| read_4byte_le(fp, &header->device[i].clock) != 4
-				|| read_4byte_le(fp, &header->device[i].pan)   != 4)
-				continue;
+			header->device[i].type  = cursor_u32le(cur);
+			header->device[i].clock = cursor_u32le(cur);
+			header->device[i].pan   = cursor_u32le(cur);
+			cursor_u32le(cur); /* reserved */
 		}
+		if (cur->overrun)
+			return false;
 	} else { /* header->version == 1 or header->device_count == 0 */
 		/* default device info:
 		 *
@@ -170,89 +177,153 @@ bool s98_parse_header(FILE *fp, struct s98_header_t *header)
 			header->device[i].pan);
 	}
 
-	/* read tag */
-	if (header->offset_tag != 0) {
+	/* read tag (not from a stream: it usually follows the dump) */
+	if (header->offset_tag != 0 && cur->refill == NULL) {
 		logging(DEBUG, "tag:\n");
 
-		efseek(fp, header->offset_tag, SEEK_SET);
-
-		while (read_string(fp, tag, S98_TAGSIZE))
-			logging(DEBUG, "%s\n", tag);
+		if (cursor_seek(cur, header->offset_tag)) {
+			while (cursor_string(cur, tag, S98_TAGSIZE))
+				logging(DEBUG, "%s\n", tag);
+		}
+		cur->overrun = false; /* a broken tag doesn't prevent playing */
 	}
 
 	/* seek to data dump offset */
-	efseek(fp, header->offset_dump, SEEK_SET);
+	return cursor_seek(cur, header->offset_dump);
+}
 
-	return true;
+const char *s98_device_name(uint32_t type)
+{
+	switch (type) {
+	case S98_YM2149:    return "YM2149";
+	case S98_YM2203:    return "YM2203";
+	case S98_YM2612:    return "YM2612";
+	case S98_YM2608:    return "YM2608";
+	case S98_YM2151:    return "YM2151";
+	case S98_YM2413:    return "YM2413";
+	case S98_YM3526:    return "YM3526";
+	case S98_YM3812:    return "YM3812";
+	case S98_YMF262:    return "YMF262";
+	case S98_AY_3_8910: return "AY-3-8910";
+	case S98_SN76489:   return "SN76489";
+	default:            return "unknown";
+	}
+}
+
+enum chip_type_t s98_chip(uint32_t type)
+{
+	if (type == S98_YM2608)
+		return CHIP_OPNA;
+	else if (type == S98_YM2151)
+		return CHIP_OPM;
+	else
+		return CHIP_NONE;
+}
+
+/*
+ * slot of every device: as given by -m, otherwise the first OPNA and
+ * the first OPM go to their slots and the others are muted
+ */
+void s98_route(struct output_t *out, const struct s98_header_t *header, int *slot)
+{
+	bool used[SPFM_MAX_SLOT] = { false };
+	uint32_t type;
+
+	for (unsigned int i = 0; i < header->device_count; i++) {
+		type = header->device[i].type;
+
+		if (opt.routes > 0)
+			slot[i] = ((int) i < opt.routes) ? opt.route[i]: ROUTE_MUTE;
+		else if (type == S98_YM2608 && !used[OPNA_SLOT_NUM])
+			slot[i] = OPNA_SLOT_NUM;
+		else if (type == S98_YM2151 && !used[OPM_SLOT_NUM])
+			slot[i] = OPM_SLOT_NUM;
+		else
+			slot[i] = ROUTE_MUTE;
+
+		if (slot[i] == ROUTE_MUTE) {
+			logging(WARN, "device %u (%s) is muted (see -m)\n", i + 1, s98_device_name(type));
+			continue;
+		}
+
+		used[slot[i]] = true;
+		out_chip(out, slot[i], s98_chip(type));
+		logging(DEBUG, "device %u (%s) -> slot %d\n", i + 1, s98_device_name(type), slot[i]);
+	}
 }
 
-void s98_wait(double step, long nsync)
+void s98_wait(struct output_t *out, long nsync)
 {
-	logging(DEBUG, "step:%lf nsync:%ld\n", step, nsync);
-	usleep(step * nsync * 1000000);
+	out_wait(out, nsync);
 }
 
 
-bool s98_play(int serial_fd, FILE *input_fp)
+bool s98_decode(struct output_t *out, struct cursor_t *cur)
 {
-	uint8_t slot, buf[BUFSIZE], op;
+	uint8_t op, dev;
+	int slot[S98_MAX_DEVICE];
+	const uint8_t *p;
 	long nsync = 0L;
-	double step;
+	uint64_t loop_offset;
 	struct s98_header_t header;
 	extern volatile sig_atomic_t catch_sigint;
 
-	if (s98_parse_header(input_fp, &header) == false) {
+	if (s98_parse_header(cur, &header) == false) {
 		logging(ERROR, "s98_parse_header() failed\n");
 		return false;
 	}
 
+	/* 1 step = numerator / denominator (sec), kept as an exact fraction */
 	if (header.numerator != 0 && header.denominator != 0)
-		step = (double) header.numerator / header.denominator;
+		out->tb = (struct timebase_t){ header.numerator, header.denominator };
 	else if (header.numerator != 0)
-		step = (double) header.numerator / S98_DEFAULT_DENOMINATOR;
+		out->tb = (struct timebase_t){ header.numerator, S98_DEFAULT_DENOMINATOR };
 	else
-		step = (double) S98_DEFAULT_NUMERATOR / S98_DEFAULT_DENOMINATOR;
+		out->tb = (struct timebase_t){ S98_DEFAULT_NUMERATOR, S98_DEFAULT_DENOMINATOR };
+
+	s98_route(out, &header, slot);
 
-	if (header.device[0].type == S98_YM2608)
-		slot = OPNA_SLOT_NUM;
-	else if (header.device[0].type == S98_YM2151)
-		slot = OPM_SLOT_NUM;
-	else /* unknown chip type */
-		slot = 0x00;
+	logging(DEBUG, "1 step: %llu/%llu (sec)\n",
+		(unsigned long long) out->tb.num, (unsigned long long) out->tb.den);
 
-	logging(DEBUG, "1 step: %lf (sec)\n", step);
+	/* absolute (0: no loop) */
+	loop_offset = header.offset_loop;
 
 	while (catch_sigint == false) {
-		if (fread(buf, 1, 1, input_fp) != 1) {
+		if (loop_offset != 0 && cur->base + cur->pos == loop_offset)
+			out_loop(out);
+
+		op = cursor_u8(cur);
+		if (cur->overrun) {
 			logging(ERROR, "couldn't read op of s98 dump\n");
 			return false;
 		}
 
-		op = buf[0];
-		logging(DEBUG, "op: 0x%.2X\n", op);
-
 		switch (op) {
-		case 0x00: /* device 1 (normal) */
-		case 0x01: /* device 1 (extended) */
-			if (fread(buf, 1, 2, input_fp) != 2) {
-				logging(ERROR, "couldn't read addr/data byte\n");
-				return false;
-			}
-			spfm_send(serial_fd, slot, op, buf[0], buf[1]);
-			break;
-		/* ignore device2, device3, ... and more */
 		case 0xFD: /* END/LOOP */
 			logging(DEBUG, "end of s98 data\n");
 			return true;
 		case 0xFE: /* n sync */
-			nsync = read_variable_length_7bit_le(input_fp);
-			s98_wait(step, nsync);
+			nsync = cursor_var7le(cur);
+			s98_wait(out, nsync);
 			break;
 		case 0xFF: /* 1 sync */
-			s98_wait(step, 1);
+			s98_wait(out, 1);
 			break;
 		default:
-			logging(WARN, "unknown S98 command:0x%.2X\n", op);
+			if (op >= 2 * S98_MAX_DEVICE) {
+				logging(WARN, "unknown S98 command:0x%.2X\n", op);
+				break;
+			}
+
+			/* device n (normal/extended): addr, data */
+			if ((p = cursor_take(cur, 2)) == NULL) {
+				logging(ERROR, "couldn't read addr/data byte\n");
+				return false;
+			}
+			dev = op >> 1;
+			if (dev < header.device_count && slot[dev] != ROUTE_MUTE)
+				out_write(out, slot[dev], op & 0x01, p[0], p[1]);
 			break;
 		}
 	}
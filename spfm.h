@@ -1,16 +1,133 @@
 /* See LICENSE for licence details. */
-enum fd_state_t {
-	FD_IS_BUSY     = -1,
-	FD_IS_READABLE = 0,
-	FD_IS_WRITABLE = 1,
+enum spfm_misc_t {
+	SPFM_FRAME_SIZE       = 4,    /* slot, command, addr, data */
+	SPFM_BATCH_SIZE       = 4096, /* must be a multiple of SPFM_FRAME_SIZE */
+	/* unbatched spfm_send(): 4 * (select() + write()) per frame */
+	SPFM_LEGACY_SYSCALLS  = 8,
+	/* the tty must accept at least one byte within this time (msec),
+	 * otherwise the device is considered dead: this is the stall bound */
+	SERIAL_STALL_TIMEOUT  = 1000,
+	SERIAL_RECV_TIMEOUT   = 1000, /* msec */
+	SPFM_LINK_RATE        = 150000, /* bytes/sec: 1500000 baud, 10 bits per byte */
+	SPFM_MAX_SLOT         = 2,
+	SPFM_MAX_PORT         = 2,
+	SPFM_MAX_REG          = 256,
+	ADPCM_MAX_RANGE       = 64,   /* ranges of ADPCM RAM remembered per slot */
+	/* ADPCM data bytes encoded per write by spfm_send_data() (3 frames each at most) */
+	SPFM_UPLOAD_CHUNK     = 1024,
 };
 
-enum check_type_t {
-	CHECK_READ_FD  = 0,
-	CHECK_WRITE_FD = 1,
+enum chip_type_t {
+	CHIP_NONE = 0, /* unknown: every write is passed through */
+	CHIP_OPM,      /* YM2151 */
+	CHIP_OPNA,     /* YM2608 */
+};
+
+/*
+ * frames queued by spfm_send() are kept here until the next wait
+ * (s98_wait()/vgm_wait()) or until the buffer fills up, and then
+ * go out with a single write()
+ */
+struct spfm_batch_t {
+	uint8_t buf[SPFM_BATCH_SIZE];
+	int len;
+
+	/* intended transmit time of each queued frame (monotonic nsec, 0: untimed) */
+	uint64_t due[SPFM_BATCH_SIZE / SPFM_FRAME_SIZE];
+	uint64_t next_due; /* stamped on the frames queued from now on */
+
+	/* statistics */
+	uint64_t frames;   /* number of frames queued */
+	uint64_t flushes;  /* number of non-empty spfm_flush() */
+	uint64_t syscalls; /* write() + poll() issued by spfm_flush() */
+};
+
+/* time spent sleeping in poll() until the tty became writable */
+struct serial_stall_t {
+	uint64_t count;
+	uint64_t total; /* nsec */
+	uint64_t max;   /* nsec */
+};
+
+/*
+ * last value written to every register of every slot/port.
+ * spfm_send() drops a write when the register already holds the value
+ * and writing it again has no side effect (see spfm_volatile_reg())
+ */
+struct spfm_shadow_t {
+	uint8_t value[SPFM_MAX_SLOT][SPFM_MAX_PORT][SPFM_MAX_REG];
+	bool valid[SPFM_MAX_SLOT][SPFM_MAX_PORT][SPFM_MAX_REG];
+
+	/* statistics */
+	uint64_t suppressed; /* number of dropped frames */
+};
+
+/*
+ * what is in the ADPCM RAM of every slot: one entry per upload, keyed by
+ * the upload registers (memory type, start, stop) and the FNV-1a hash of
+ * the data. it lives as long as the chips aren't reset, so a track
+ * uploading the same sample bank as the previous one skips the data.
+ * anything that writes the RAM outside spfm_send_data() forgets the slot
+ */
+struct adpcm_range_t {
+	uint8_t type;        /* control 2 (0x01): memory type */
+	uint16_t start, stop; /* 0x02-0x03, 0x04-0x05 */
+	uint64_t hash;
+};
+
+struct spfm_adpcm_t {
+	struct adpcm_range_t range[SPFM_MAX_SLOT][ADPCM_MAX_RANGE];
+	int ranges[SPFM_MAX_SLOT];
+	struct adpcm_range_t reg[SPFM_MAX_SLOT]; /* upload registers last written (no hash) */
+
+	/* statistics */
+	uint64_t resident; /* uploads skipped */
+	uint64_t saved;    /* data bytes not sent */
+};
+
+/*
+ * ADPCM data sent by spfm_send_data(): encoded into buf one chunk at a
+ * time, so memory doesn't depend on the size of the data block
+ */
+struct spfm_upload_t {
+	uint8_t buf[SPFM_UPLOAD_CHUNK * 3 * SPFM_FRAME_SIZE];
+
+	/* statistics */
+	uint64_t blocks;
+	uint64_t frames;
+	uint64_t data;   /* ADPCM bytes (writes to the data port) */
+	uint64_t nsec;   /* time spent sending them */
+};
+
+struct spfm_batch_t spfm_batch;
+struct spfm_upload_t spfm_upload;
+struct spfm_adpcm_t spfm_adpcm;
+struct serial_stall_t serial_stall;
+struct spfm_shadow_t spfm_shadow;
+struct hist_t spfm_lateness; /* actual - intended transmit time of every timed frame */
+
+/* chips of a file that doesn't say otherwise */
+const enum chip_type_t spfm_default_chip[SPFM_MAX_SLOT] = {
+	[OPM_SLOT_NUM]  = CHIP_OPM,
+	[OPNA_SLOT_NUM] = CHIP_OPNA,
+};
+
+/*
+ * chip mounted on each slot (decides which registers have side effects).
+ * set from the file header of the track being played, see spfm_set_chip()
+ */
+enum chip_type_t spfm_chip[SPFM_MAX_SLOT] = {
+	[OPM_SLOT_NUM]  = CHIP_OPM,
+	[OPNA_SLOT_NUM] = CHIP_OPNA,
 };
 
 /* spfm functions */
+void spfm_set_chip(uint8_t slot, enum chip_type_t chip)
+{
+	if (slot < SPFM_MAX_SLOT)
+		spfm_chip[slot] = chip;
+}
+
 int serial_init(struct termios *old_termio)
 {
 	int fd = -1;
@@ -118,80 +235,134 @@ void serial_die(int fd, struct termios *old_termio)
  *
  */
 
-enum fd_state_t check_fds(int fd, enum check_type_t type)
+/*
+ * serial writer:
+ *
+ * the fd is non-blocking (O_NDELAY), so write() as much as the tty
+ * accepts and only when it returns EAGAIN wait in loop_wait_writable()
+ * until the driver has drained its output queue. there is no
+ * fixed-interval sleep: the worst case stall is bounded by
+ * SERIAL_STALL_TIMEOUT and the observed stalls are recorded in serial_stall.
+ *
+ * if abortable, a stop request drops the rest of the buffer (after the
+ * frame being sent is completed, so the device never loses frame sync)
+ */
+bool send_data(int fd, const uint8_t *buf, int size, bool abortable)
 {
-	struct timeval tv;
-	fd_set rfds, wfds;
-
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-
-	FD_SET(fd, &rfds);
-	FD_SET(fd, &wfds);
-
-	tv.tv_sec  = 0;
-	tv.tv_usec = SELECT_TIMEOUT;
+	ssize_t wsize;
+	int sent = 0;
+	uint64_t start, stall;
+
+	while (sent < size) {
+		if (abortable && catch_sigint) {
+			size = sent + (SPFM_FRAME_SIZE - sent % SPFM_FRAME_SIZE) % SPFM_FRAME_SIZE;
+			abortable = false;
+			continue;
+		}
+
+		errno = 0;
+		wsize = write(fd, buf + sent, size - sent);
+		spfm_batch.syscalls++;
+
+		if (wsize > 0) {
+			sent += wsize;
+			continue;
+		} else if (wsize < 0 && errno == EINTR) {
+			continue;
+		} else if (wsize < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			logging(ERROR, "write: %s\n", strerror(errno));
+			return false;
+		}
+
+		/* tty output queue is full */
+		start = now_nsec();
+		spfm_batch.syscalls++;
+		if (!loop_wait_writable(fd, SERIAL_STALL_TIMEOUT, abortable)) {
+			if (abortable && catch_sigint)
+				continue;
+			logging(ERROR, "serial device didn't become writable in %d msec\n", SERIAL_STALL_TIMEOUT);
+			return false;
+		}
+		stall = now_nsec() - start;
+
+		serial_stall.count++;
+		serial_stall.total += stall;
+		if (stall > serial_stall.max)
+			serial_stall.max = stall;
+	}
+	return true;
+}
 
-	eselect(fd + 1, &rfds, &wfds, NULL, &tv);
+ssize_t recv_data(int fd, uint8_t *buf, int size)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
 
-	if (type == CHECK_READ_FD && FD_ISSET(fd, &rfds))
-		return FD_IS_READABLE;
-	else if (type == CHECK_WRITE_FD && FD_ISSET(fd, &wfds))
-		return FD_IS_WRITABLE;
-	else
-		return FD_IS_BUSY;
+	if (xpoll(&pfd, 1, SERIAL_RECV_TIMEOUT) <= 0) {
+		logging(ERROR, "no response from serial device in %d msec\n", SERIAL_RECV_TIMEOUT);
+		return -1;
+	}
+	return eread(fd, buf, size);
 }
 
-void send_data(int fd, uint8_t *buf, int size)
+/* account lateness per run of frames sharing the same deadline */
+void spfm_record_lateness(uint64_t sent)
 {
-	ssize_t wsize;
-	
-	while (check_fds(fd, CHECK_WRITE_FD) != FD_IS_WRITABLE);
+	int i, run, frames = spfm_batch.len / SPFM_FRAME_SIZE;
+	uint64_t due;
 
-	wsize = ewrite(fd, buf, size);
+	for (i = 0; i < frames; i += run) {
+		due = spfm_batch.due[i];
+		for (run = 1; i + run < frames && spfm_batch.due[i + run] == due; run++);
 
-	/*
-	if (LOG_LEVEL == DEBUG) {
-		logging(DEBUG, "%ld byte(s) wrote\t", wsize);
-		for (int i = 0; i < wsize; i++)
-			fprintf(stderr, "0x%.2X ", buf[i]);
-		fprintf(stderr, "\n");
+		if (due != 0)
+			hist_add(&spfm_lateness, (sent > due) ? sent - due: 0, run);
 	}
-	*/
 }
 
-void recv_data(int fd, uint8_t *buf, int size)
+void spfm_flush(int fd)
 {
-	ssize_t rsize;
+	if (spfm_batch.len == 0)
+		return;
 
-	while (check_fds(fd, CHECK_READ_FD) != FD_IS_READABLE);
+	send_data(fd, spfm_batch.buf, spfm_batch.len, true);
+	spfm_record_lateness(now_nsec());
 
-	rsize = eread(fd, buf, size);
+	spfm_batch.flushes++;
+	spfm_batch.len = 0;
+}
 
-	/*
-	if (LOG_LEVEL == DEBUG) {
-		logging(DEBUG, "%ld byte(s) read\t", rsize);
-		for (int i = 0; i < rsize; i++)
-			fprintf(stderr, "0x%.2X ('%c') ", buf[i], buf[i]);
-		fprintf(stderr, "\n");
-	}
-	*/
+/* frames queued after this call are intended to leave at deadline (monotonic nsec) */
+void spfm_set_due(uint64_t deadline)
+{
+	spfm_batch.next_due = deadline;
+}
+
+/* a stop drops queued frames (see send_data()): the shadow may hold values never sent */
+void spfm_shadow_forget(void)
+{
+	memset(spfm_shadow.valid, 0, sizeof(spfm_shadow.valid));
 }
 
 bool spfm_reset(int fd)
 {
 	uint8_t buf[BUFSIZE];
 
-	send_data(fd, &(uint8_t){0xFF}, 1);
-	recv_data(fd, buf, BUFSIZE);
+	/* don't let queued frames arrive after the reset */
+	spfm_flush(fd);
 
-	if (strncmp((char *) buf, "LT", 2) != 0)
-		return false;
+	/* chip state is unknown (power-on default) after the reset */
+	spfm_shadow_forget();
+	memset(spfm_adpcm.ranges, 0, sizeof(spfm_adpcm.ranges));
+	memset(spfm_adpcm.reg, 0, sizeof(spfm_adpcm.reg));
 
-	send_data(fd, &(uint8_t){0xFE}, 1);
-	recv_data(fd, buf, BUFSIZE);
+	if (!send_data(fd, &(uint8_t){0xFF}, 1, false)
+		|| recv_data(fd, buf, BUFSIZE) < 2
+		|| strncmp((char *) buf, "LT", 2) != 0)
+		return false;
 
-	if (strncmp((char *) buf, "OK", 2) != 0)
+	if (!send_data(fd, &(uint8_t){0xFE}, 1, false)
+		|| recv_data(fd, buf, BUFSIZE) < 2
+		|| strncmp((char *) buf, "OK", 2) != 0)
 		return false;
 
 	return true;
@@ -220,19 +391,291 @@ void OPNA_register_info(uint8_t port, uint8_t addr)
 	}
 }
 
-void spfm_send(int fd, uint8_t slot, uint8_t port, uint8_t addr, uint8_t data)
+/* registers which must be written every time, even with the same value */
+bool spfm_volatile_reg(enum chip_type_t chip, uint8_t port, uint8_t addr)
+{
+	if (chip == CHIP_OPM) {
+		return addr == 0x01      /* test, LFO reset */
+			|| addr == 0x08  /* key on/off */
+			|| addr == 0x14  /* timer control, flag reset, CSM */
+			|| addr == 0x19; /* AMD/PMD share one address */
+	} else if (chip == CHIP_OPNA) {
+		/* F-number: the high byte is latched until the low byte is written */
+		if (0xA0 <= addr && addr <= 0xAE)
+			return true;
+
+		if (port == 0x00)
+			return addr == 0x0D  /* SSG envelope shape restarts the envelope */
+				|| addr == 0x10  /* rhythm key on/dump */
+				|| addr == 0x27  /* timer control, flag reset, CH3 mode */
+				|| addr == 0x28  /* key on/off */
+				|| addr == 0x29  /* IRQ enable, 6ch mode */
+				|| (0x2D <= addr && addr <= 0x2F); /* prescaler (address only) */
+		else
+			return addr <= 0x10; /* ADPCM control, memory access, data port 0x08, flag 0x10 */
+	}
+	return true;
+}
+
+/* true if the write can't change chip state and may be dropped */
+bool spfm_shadow_hit(uint8_t slot, uint8_t port, uint8_t addr, uint8_t data)
 {
-	send_data(fd, &slot, 1);
+	if (slot >= SPFM_MAX_SLOT || port >= SPFM_MAX_PORT
+		|| spfm_volatile_reg(spfm_chip[slot], port, addr))
+		return false;
 
-	if (port == 0x00)
-		send_data(fd, &(uint8_t){0x00}, 1);
-	else /* OPNA extend: A1 bit on */
-		send_data(fd, &(uint8_t){0x02}, 1);
+	if (spfm_shadow.valid[slot][port][addr] && spfm_shadow.value[slot][port][addr] == data)
+		return true;
 
-	send_data(fd, &addr, 1);
+	spfm_shadow.valid[slot][port][addr] = true;
+	spfm_shadow.value[slot][port][addr] = data;
+	return false;
+}
 
-	send_data(fd, &data, 1);
+/* encode one register write into a wire frame (slot, command, addr, data) */
+void spfm_encode(uint8_t *frame, uint8_t slot, uint8_t port, uint8_t addr, uint8_t data)
+{
+	frame[0] = slot;
+	/* OPNA extend: A1 bit on */
+	frame[1] = (port == 0x00) ? 0x00: 0x02;
+	frame[2] = addr;
+	frame[3] = data;
+}
+
+/* keep the ADPCM upload registers, see spfm_send_data() */
+void spfm_adpcm_reg(const uint8_t *frame)
+{
+	struct adpcm_range_t *r;
+
+	if (frame[0] >= SPFM_MAX_SLOT || spfm_chip[frame[0]] != CHIP_OPNA || (frame[1] >> 1) != 0x01)
+		return;
+	r = &spfm_adpcm.reg[frame[0]];
+
+	switch (frame[2]) {
+	case 0x01: r->type  = frame[3]; break;
+	case 0x02: r->start = (r->start & 0xFF00) | frame[3]; break;
+	case 0x03: r->start = (r->start & 0x00FF) | (frame[3] << 8); break;
+	case 0x04: r->stop  = (r->stop & 0xFF00) | frame[3]; break;
+	case 0x05: r->stop  = (r->stop & 0x00FF) | (frame[3] << 8); break;
+	case 0x08: /* RAM written register by register (S98): its content is unknown */
+		spfm_adpcm.ranges[frame[0]] = 0;
+		break;
+	}
+}
+
+void spfm_send_frame(int fd, const uint8_t *frame)
+{
+	spfm_adpcm_reg(frame);
+
+	if (spfm_shadow_hit(frame[0], frame[1] >> 1, frame[2], frame[3])) {
+		spfm_shadow.suppressed++;
+		return;
+	}
+
+	if (spfm_batch.len + SPFM_FRAME_SIZE > SPFM_BATCH_SIZE)
+		spfm_flush(fd);
+
+	memcpy(spfm_batch.buf + spfm_batch.len, frame, SPFM_FRAME_SIZE);
+
+	spfm_batch.due[spfm_batch.len / SPFM_FRAME_SIZE] = spfm_batch.next_due;
+	spfm_batch.len += SPFM_FRAME_SIZE;
+	spfm_batch.frames++;
 
 	logging(DEBUG, "slot:0x%.2X port:0x%.2X addr:0x%.2X data:0x%.2X\n",
-		slot, port, addr, data);
+		frame[0], frame[1] >> 1, frame[2], frame[3]);
+}
+
+void spfm_send(int fd, uint8_t slot, uint8_t port, uint8_t addr, uint8_t data)
+{
+	uint8_t frame[SPFM_FRAME_SIZE];
+
+	spfm_encode(frame, slot, port, addr, data);
+	spfm_send_frame(fd, frame);
+}
+
+/*
+ * between tracks of one session: stop every sound without a reset, which
+ * would clear the ADPCM RAM (see struct spfm_adpcm_t)
+ */
+void spfm_silence(int fd)
+{
+	for (uint8_t slot = 0; slot < SPFM_MAX_SLOT; slot++) {
+		if (spfm_chip[slot] == CHIP_OPM) {
+			for (uint8_t ch = 0; ch < 8; ch++)
+				spfm_send(fd, slot, 0x00, 0x08, ch);
+		} else if (spfm_chip[slot] == CHIP_OPNA) {
+			for (uint8_t ch = 0; ch < 7; ch++) {
+				if (ch != 3) /* channel 3 doesn't exist */
+					spfm_send(fd, slot, 0x00, 0x28, ch);
+			}
+			spfm_send(fd, slot, 0x00, 0x07, 0x3F); /* SSG: tone and noise off */
+			spfm_send(fd, slot, 0x00, 0x10, 0xBF); /* rhythm: dump all */
+			spfm_send(fd, slot, 0x01, 0x00, 0x01); /* ADPCM: reset */
+			spfm_send(fd, slot, 0x01, 0x00, 0x00);
+		}
+	}
+	spfm_flush(fd);
+}
+
+/* true if the range is already in the RAM of the slot */
+bool spfm_adpcm_resident(uint8_t slot, const struct adpcm_range_t *r)
+{
+	const struct adpcm_range_t *e = spfm_adpcm.range[slot];
+
+	for (int i = 0; i < spfm_adpcm.ranges[slot]; i++) {
+		if (e[i].type == r->type && e[i].start == r->start
+			&& e[i].stop == r->stop && e[i].hash == r->hash)
+			return true;
+	}
+	return false;
+}
+
+/* the range has been uploaded: forget what it overwrote */
+void spfm_adpcm_store(uint8_t slot, const struct adpcm_range_t *r)
+{
+	struct adpcm_range_t *e = spfm_adpcm.range[slot];
+	int n = 0;
+
+	for (int i = 0; i < spfm_adpcm.ranges[slot]; i++) {
+		/* another memory type uses other address units: no overlap test */
+		if (e[i].type != r->type) {
+			n = 0;
+			break;
+		}
+		if (e[i].stop < r->start || r->stop < e[i].start)
+			e[n++] = e[i];
+	}
+
+	if (n == ADPCM_MAX_RANGE) /* forget the oldest one */
+		memmove(e, e + 1, --n * sizeof(struct adpcm_range_t));
+	e[n++] = *r;
+	spfm_adpcm.ranges[slot] = n;
+}
+
+/* one ADPCM byte to the data port, and the BRDY flag reset of the YM2608 manual (not with -f) */
+int spfm_encode_data(uint8_t *frame, uint8_t slot, uint8_t data)
+{
+	spfm_encode(frame, slot, 0x01, 0x08, data);
+	if (opt.fast_upload) /* -f: the chip keeps up with the link without BRDY */
+		return 1;
+
+	spfm_encode(frame + SPFM_FRAME_SIZE, slot, 0x01, 0x10, 0x1B);
+	spfm_encode(frame + 2 * SPFM_FRAME_SIZE, slot, 0x01, 0x10, 0x13);
+	return 3;
+}
+
+/*
+ * send ADPCM data to the data port of the slot, whose upload registers
+ * (memory write mode, start/stop) are already written. every chunk is
+ * encoded into spfm_upload.buf and goes out with one send_data(), which
+ * returns as soon as the tty has taken it: the caller reads the next
+ * piece of input while it is on the wire.
+ * whole: data is all the data of the upload (not a piece of a stream),
+ * which can be skipped if the RAM already holds it
+ */
+void spfm_send_data(int fd, uint8_t slot, const uint8_t *data, uint32_t size, bool whole)
+{
+	uint64_t start;
+	uint32_t count, chunk;
+	int len;
+	struct adpcm_range_t r;
+	bool known = whole && slot < SPFM_MAX_SLOT && spfm_chip[slot] == CHIP_OPNA;
+
+	if (known) {
+		r      = spfm_adpcm.reg[slot];
+		r.hash = fnv1a(fnv_offset_basis, data, size);
+		if (spfm_adpcm_resident(slot, &r)) {
+			spfm_adpcm.resident++;
+			spfm_adpcm.saved += size;
+			return;
+		}
+	}
+
+	spfm_flush(fd);
+
+	start = now_nsec();
+	if (spfm_batch.next_due != 0)
+		hist_add(&spfm_lateness, (start > spfm_batch.next_due) ? start - spfm_batch.next_due: 0, size);
+
+	for (count = 0; count < size && catch_sigint == false; count += chunk) {
+		chunk = (size - count < SPFM_UPLOAD_CHUNK) ? size - count: SPFM_UPLOAD_CHUNK;
+		len   = 0;
+		for (uint32_t i = 0; i < chunk; i++)
+			len += spfm_encode_data(spfm_upload.buf + len * SPFM_FRAME_SIZE, slot, data[count + i]);
+
+		send_data(fd, spfm_upload.buf, len * SPFM_FRAME_SIZE, true);
+		spfm_upload.frames += len;
+		spfm_batch.frames  += len;
+		spfm_batch.flushes++;
+
+		/* a tty that never fills never waits in loop_wait_writable(): serve commands here */
+		loop_serve();
+	}
+
+	spfm_upload.nsec += now_nsec() - start;
+	spfm_upload.blocks++;
+	spfm_upload.data += count;
+
+	/* a stop in the middle leaves the range half written */
+	if (slot >= SPFM_MAX_SLOT)
+		return;
+	else if (known && !catch_sigint)
+		spfm_adpcm_store(slot, &r);
+	else
+		spfm_adpcm.ranges[slot] = 0;
+}
+
+/* start counting for a new track: nothing sent before it (e.g. spfm_silence()) counts */
+void spfm_stat_reset(void)
+{
+	spfm_batch.frames = spfm_batch.flushes = spfm_batch.syscalls = 0;
+	spfm_batch.next_due = 0;
+	spfm_shadow.suppressed = 0;
+	memset(&serial_stall, 0, sizeof(struct serial_stall_t));
+	spfm_upload.blocks = spfm_upload.frames = spfm_upload.data = spfm_upload.nsec = 0;
+	spfm_adpcm.resident = spfm_adpcm.saved = 0;
+	memset(&spfm_lateness, 0, sizeof(struct hist_t));
+}
+
+/* print statistics of the track and start counting again */
+void spfm_report(void)
+{
+	double per_frame;
+
+	if (spfm_batch.frames + spfm_shadow.suppressed == 0)
+		return;
+
+	logging(INFO, "shadow: %llu redundant write(s) dropped, %llu byte(s) saved\n",
+		(unsigned long long) spfm_shadow.suppressed,
+		(unsigned long long) spfm_shadow.suppressed * SPFM_FRAME_SIZE);
+
+	per_frame = (spfm_batch.frames > 0) ? (double) spfm_batch.syscalls / spfm_batch.frames: 0;
+
+	logging(INFO, "spfm: %llu frame(s) in %llu write(s), %.3f syscall(s)/frame (saved %.3f/frame)\n",
+		(unsigned long long) spfm_batch.frames, (unsigned long long) spfm_batch.flushes,
+		per_frame, SPFM_LEGACY_SYSCALLS - per_frame);
+
+	logging(INFO, "serial: %llu stall(s), total %.3f msec, worst %.3f msec (bound %d msec)\n",
+		(unsigned long long) serial_stall.count,
+		(double) serial_stall.total / NSEC_PER_MSEC,
+		(double) serial_stall.max / NSEC_PER_MSEC, SERIAL_STALL_TIMEOUT);
+
+	if (spfm_upload.blocks > 0)
+		logging(INFO, "upload: %.1f KB of ADPCM data in %llu block(s), %.1f KB sent in %.3f sec (%.1f KB/s)\n",
+			(double) spfm_upload.data / 1024, (unsigned long long) spfm_upload.blocks,
+			(double) spfm_upload.frames * SPFM_FRAME_SIZE / 1024, (double) spfm_upload.nsec / NSEC_PER_SEC,
+			(spfm_upload.nsec > 0) ? (double) spfm_upload.data / 1024 * NSEC_PER_SEC / spfm_upload.nsec: 0);
+
+	if (spfm_adpcm.resident > 0)
+		logging(INFO, "adpcm: %llu upload(s) already in RAM, %.1f KB of data not sent\n",
+			(unsigned long long) spfm_adpcm.resident, (double) spfm_adpcm.saved / 1024);
+
+	if (spfm_lateness.count > 0)
+		logging(INFO, "lateness: %llu frame(s), p50 %.3f msec, p99 %.3f msec, max %.3f msec\n",
+			(unsigned long long) spfm_lateness.count,
+			(double) hist_percentile(&spfm_lateness, 0.50) / NSEC_PER_MSEC,
+			(double) hist_percentile(&spfm_lateness, 0.99) / NSEC_PER_MSEC,
+			(double) spfm_lateness.max / NSEC_PER_MSEC);
+
+	spfm_stat_reset();
 }
@@ -0,0 +1,282 @@
+/* See LICENSE for licence details. */
+/*
+	spfmemu: SPFM Light stand-in on a pseudo terminal
+
+	answers the check/reset handshake of spfm_reset(), decodes the
+	frames described in spfm.h and timestamps each of them, so that
+	yasp can be run and measured without the real hardware:
+
+		$ spfmemu -o frames.log &
+		spfmemu: /dev/pts/3
+		$ yasp -d /dev/pts/3 song.vgm
+
+	the emulated link drains at the SPFM Light baud rate (1500000),
+	so the pty backs up and yasp sees the same write stalls as on the
+	real device. every line of the frame log is:
+
+		<sec since reset> <slot> <port> <addr> <data>
+*/
+#include "yasp.h"
+#include "error.h"
+#include "timer.h"
+
+enum emu_misc_t {
+	EMU_READ_SIZE    = 4096,
+	EMU_DEFAULT_BAUD = 1500000,
+	SERIAL_BYTE_BITS = 10, /* start bit + 8 data bits + stop bit */
+	FRAME_MAX        = 6,
+};
+
+struct emu_t {
+	int master, slave;
+	FILE *log_fp;
+	long baud;            /* 0: unlimited */
+
+	uint8_t frame[FRAME_MAX];
+	int len, need;        /* bytes of the current frame received/expected */
+
+	uint64_t origin;      /* time of the last reset */
+	uint64_t link;        /* time the emulated link delivers the last byte */
+
+	/* statistics since the last reset */
+	uint64_t frames, bytes, reads, first, last;
+};
+
+void usage()
+{
+	printf(
+		"usage: spfmemu [-l LINK] [-o LOG] [-b BAUD]\n"
+		"\t-l: create symlink LINK to the pty slave (e.g. /tmp/ttySPFM)\n"
+		"\t-o: write every received frame with its timestamp to LOG\n"
+		"\t-b: emulated link speed (default %d, 0: unlimited)\n",
+		EMU_DEFAULT_BAUD
+	);
+}
+
+void sig_handler(int signo)
+{
+	extern volatile sig_atomic_t catch_sigint;
+
+	if (signo == SIGINT || signo == SIGTERM)
+		catch_sigint = true;
+}
+
+int set_signal(int signo, void (*sig_handler)(int signo))
+{
+	struct sigaction sigact;
+
+	/* no SA_RESTART: read() on the pty must return on SIGINT */
+	memset(&sigact, 0, sizeof(struct sigaction));
+	sigact.sa_handler = sig_handler;
+	return esigaction(signo, &sigact, NULL);
+}
+
+void emu_report(struct emu_t *emu)
+{
+	double elapsed;
+
+	if (emu->frames == 0)
+		return;
+
+	elapsed = (double) (emu->last - emu->first) / NSEC_PER_SEC;
+
+	fprintf(stderr, "spfmemu: %llu frame(s), %llu byte(s) in %llu read(s) over %.3f sec",
+		(unsigned long long) emu->frames, (unsigned long long) emu->bytes,
+		(unsigned long long) emu->reads, elapsed);
+	if (elapsed > 0) {
+		fprintf(stderr, ", %.1f KB/s", emu->bytes / elapsed / 1024);
+		if (emu->baud > 0)
+			fprintf(stderr, " (link %.1f%% busy)",
+				100.0 * emu->bytes * SERIAL_BYTE_BITS / emu->baud / elapsed);
+	}
+	fprintf(stderr, "\n");
+}
+
+void emu_reset(struct emu_t *emu, uint64_t now)
+{
+	emu_report(emu);
+
+	emu->origin = now;
+	emu->frames = emu->bytes = emu->reads = 0;
+	emu->first  = emu->last = 0;
+
+	if (emu->log_fp)
+		fprintf(emu->log_fp, "# reset\n");
+}
+
+void emu_frame(struct emu_t *emu, uint64_t arrival)
+{
+	uint8_t *f = emu->frame;
+
+	if (emu->frames == 0)
+		emu->first = arrival;
+	emu->last = arrival;
+	emu->frames++;
+
+	if (emu->log_fp == NULL)
+		return;
+
+	/* register write: slot, command (A0-A3), addr, data */
+	if (emu->len == 4)
+		fprintf(emu->log_fp, "%.6f %u %u 0x%.2X 0x%.2X\n",
+			(double) (arrival - emu->origin) / NSEC_PER_SEC,
+			f[0], (f[1] >> 1) & 0x01, f[2], f[3]);
+	else
+		fprintf(emu->log_fp, "%.6f %u cmd:0x%.2X data:0x%.2X\n",
+			(double) (arrival - emu->origin) / NSEC_PER_SEC, f[0], f[1], f[2]);
+}
+
+void emu_byte(struct emu_t *emu, uint8_t byte, uint64_t arrival)
+{
+	if (emu->len == 0) {
+		switch (byte) {
+		case 0xFF: /* check interface */
+			ewrite(emu->master, "LT", 2);
+			return;
+		case 0xFE: /* reset */
+			emu_reset(emu, arrival);
+			ewrite(emu->master, "OK", 2);
+			return;
+		case 0x80: /* nop */
+			return;
+		}
+	}
+
+	emu->frame[emu->len++] = byte;
+
+	/* the command byte decides the frame length */
+	if (emu->len == 2) {
+		if (byte & 0x80)         /* send data */
+			emu->need = 3;
+		else if (byte == 0x20)   /* SN76489 */
+			emu->need = 6;
+		else                     /* register write */
+			emu->need = 4;
+	}
+
+	if (emu->len >= 2 && emu->len == emu->need) {
+		emu_frame(emu, arrival);
+		emu->len = emu->need = 0;
+	}
+}
+
+void emu_sleep_until(uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec  = deadline / NSEC_PER_SEC,
+		.tv_nsec = deadline % NSEC_PER_SEC,
+	};
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+void emu_run(struct emu_t *emu)
+{
+	uint8_t buf[EMU_READ_SIZE];
+	uint64_t now, byte_time;
+	ssize_t size;
+
+	byte_time = (emu->baud > 0) ? (uint64_t) SERIAL_BYTE_BITS * NSEC_PER_SEC / emu->baud: 0;
+
+	while (catch_sigint == false) {
+		if ((size = read(emu->master, buf, EMU_READ_SIZE)) <= 0) {
+			if (size < 0 && errno != EINTR)
+				logging(ERROR, "read: %s\n", strerror(errno));
+			if (size == 0 || errno != EINTR)
+				break;
+			continue;
+		}
+
+		now = now_nsec();
+		if (emu->link < now)
+			emu->link = now;
+
+		emu->reads++;
+		emu->bytes += size;
+
+		for (ssize_t i = 0; i < size; i++) {
+			emu->link += byte_time;
+			emu_byte(emu, buf[i], emu->link);
+		}
+
+		/* don't take more bytes than the link could have carried by now */
+		if (byte_time > 0)
+			emu_sleep_until(emu->link);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	const char *link_path = NULL, *log_path = NULL, *name;
+	struct termios raw;
+	struct emu_t emu;
+
+	memset(&emu, 0, sizeof(struct emu_t));
+	emu.baud = EMU_DEFAULT_BAUD;
+
+	while ((c = getopt(argc, argv, "l:o:b:")) != -1) {
+		switch (c) {
+		case 'l':
+			link_path = optarg;
+			break;
+		case 'o':
+			log_path = optarg;
+			break;
+		case 'b':
+			emu.baud = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* same line setting as serial_init() */
+	memset(&raw, 0, sizeof(struct termios));
+	raw.c_cflag = CS8 | CREAD;
+	raw.c_cc[VMIN]  = 1;
+	raw.c_cc[VTIME] = 0;
+
+	/* keep the slave open: the master must not see EOF between yasp runs */
+	if (eopenpty(&emu.master, &emu.slave, NULL, &raw, NULL) < 0 || emu.slave < 0)
+		return EXIT_FAILURE;
+
+	name = ptsname(emu.master);
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(name, link_path) < 0) {
+			logging(ERROR, "symlink: %s\n", strerror(errno));
+			goto err;
+		}
+	}
+
+	if (log_path && (emu.log_fp = efopen(log_path, "w")) == NULL)
+		goto err;
+
+	if (set_signal(SIGINT, sig_handler) < 0 || set_signal(SIGTERM, sig_handler) < 0)
+		goto err;
+
+	printf("spfmemu: %s\n", link_path ? link_path: name);
+	fflush(stdout);
+
+	emu.origin = now_nsec();
+	emu_run(&emu);
+	emu_report(&emu);
+
+	if (emu.log_fp)
+		efclose(emu.log_fp);
+	if (link_path)
+		unlink(link_path);
+	eclose(emu.slave);
+	eclose(emu.master);
+	return EXIT_SUCCESS;
+
+err:
+	if (emu.log_fp)
+		efclose(emu.log_fp);
+	eclose(emu.slave);
+	eclose(emu.master);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,390 @@
+/* See LICENSE for licence details. */
+/*
+	compiled timeline
+
+	s98_decode()/vgm_decode() run once before playing and their output is
+	compiled into two flat arrays:
+
+		frame[]: every register write as a ready-to-send SPFM frame, in order
+		group[]: one entry per distinct timestamp (absolute nsec), pointing
+		         at the frames sent at that time
+
+	sync arithmetic, wait opcodes, wait overrides and slot selection are all
+	resolved by then: timeline_play() only walks the groups in order.
+
+	ADPCM data blocks are kept as they are in data[], with a block[] entry
+	saying before which frame they go: encoded, every byte would take up
+	to three frames (12 bytes). spfm_send_data() encodes them while sending.
+
+	the loop point of the input (VGM loop offset, S98 offset_loop) is
+	resolved to a group index: looping jumps back to that group and
+	shifts the following timestamps by the length of the loop section,
+	so the seam is neither re-parsed nor heard as a gap
+*/
+
+enum timeline_misc_t {
+	TIMELINE_INIT_FRAMES = 4096,
+	TIMELINE_INIT_GROUPS = 1024,
+	TIMELINE_INIT_BLOCKS = 16,
+	TIMELINE_INIT_DATA   = 64 * 1024,
+};
+
+struct tl_group_t {
+	uint64_t time;  /* nsec from the beginning of the track */
+	uint32_t first; /* index of the first frame */
+	uint32_t count; /* number of frames */
+};
+
+/* ADPCM data block of the input (see out_data()) */
+struct tl_block_t {
+	uint64_t offset;  /* in data[] */
+	uint32_t frame;   /* sent before this frame */
+	uint32_t size;    /* bytes */
+	uint8_t slot;
+	uint8_t reserved[7];
+};
+
+/*
+ * an ADPCM RAM upload (memory write mode), found by keyframe_build(): the
+ * frames from first on are a span, in which only port 1 of the slot
+ * belongs to the upload (see tl_upload_owns())
+ */
+struct tl_upload_t {
+	uint64_t time;  /* time of its first frame (nsec) */
+	uint32_t first; /* index of the first frame */
+	uint32_t count; /* number of frames in the span */
+
+	/* filled in by hoist_plan() */
+	uint32_t size;        /* bytes of ADPCM data */
+	uint16_t start, stop; /* RAM range (0x02-0x05) */
+	uint8_t slot;         /* set by keyframe_build() */
+	uint8_t type;         /* memory type (0x01) */
+	uint8_t hoisted;      /* data sent before the track, not in place (see hoist.h) */
+	uint8_t reserved[5];
+};
+
+struct timeline_t {
+	uint8_t *frame; /* frames * SPFM_FRAME_SIZE bytes */
+	uint32_t frames, frame_cap;
+
+	struct tl_group_t *group;
+	uint32_t groups, group_cap;
+
+	struct tl_block_t *block;
+	uint32_t blocks, block_cap;
+	uint8_t *data;  /* data of every block */
+	uint32_t data_size, data_cap;
+
+	uint64_t end;   /* position of the end of the track (nsec) */
+	bool error;     /* allocation failed while compiling */
+
+	uint8_t chip[SPFM_MAX_SLOT]; /* chip of every slot (EVENT_CHIP), see track_start() */
+
+	uint32_t loop_group; /* first group of the loop section (groups: no loop) */
+	uint64_t loop_time;  /* position of the loop point (nsec) */
+
+	/* seek index and uploads, built after compiling (see keyframe.h) */
+	struct keyframe_t *keyframe;
+	uint32_t keyframes, keyframe_cap;
+	struct tl_upload_t *upload;
+	uint32_t uploads, upload_cap;
+
+	/* loaded from the cache: frame/group point into this mapping (see cache.h) */
+	void *map;
+	size_t map_size;
+};
+
+/* timeline functions */
+void timeline_die(struct timeline_t *tl)
+{
+	if (tl->map) {
+		emunmap(tl->map, tl->map_size);
+	} else {
+		free(tl->frame);
+		free(tl->group);
+		free(tl->block);
+		free(tl->data);
+		free(tl->keyframe);
+		free(tl->upload);
+	}
+	memset(tl, 0, sizeof(struct timeline_t));
+}
+
+/* make room for need elements of an array (doubling) */
+bool timeline_reserve(void **array, uint32_t *cap, uint32_t need, size_t size, uint32_t init)
+{
+	void *new;
+	uint32_t new_cap;
+
+	if (need <= *cap)
+		return true;
+
+	for (new_cap = (*cap == 0) ? init: *cap; new_cap < need; new_cap *= 2) {
+		if (new_cap > UINT32_MAX / 2)
+			return false;
+	}
+	if ((new = erealloc(*array, (size_t) new_cap * size)) == NULL)
+		return false;
+
+	*array = new;
+	*cap   = new_cap;
+	return true;
+}
+
+/* make room for one more element of an array */
+bool timeline_grow(void **array, uint32_t *cap, uint32_t count, size_t size, uint32_t init)
+{
+	return count < UINT32_MAX && timeline_reserve(array, cap, count + 1, size, init);
+}
+
+/* append a piece of a data block: pieces of the same block are joined */
+bool timeline_emit_data(struct timeline_t *tl, const struct event_t *ev)
+{
+	struct tl_block_t *last = (tl->blocks > 0) ? &tl->block[tl->blocks - 1]: NULL;
+
+	if (ev->count > UINT32_MAX - tl->data_size
+		|| !timeline_reserve((void **) &tl->data, &tl->data_cap, tl->data_size + ev->count, 1, TIMELINE_INIT_DATA))
+		return false;
+
+	if (last == NULL || last->frame != tl->frames || last->slot != ev->frame[0]) {
+		if (!timeline_grow((void **) &tl->block, &tl->block_cap, tl->blocks,
+			sizeof(struct tl_block_t), TIMELINE_INIT_BLOCKS))
+			return false;
+		last = &tl->block[tl->blocks++];
+		*last = (struct tl_block_t){ .offset = tl->data_size, .frame = tl->frames, .slot = ev->frame[0] };
+	}
+
+	memcpy(tl->data + tl->data_size, ev->data, ev->count);
+	tl->data_size += ev->count;
+	last->size    += ev->count;
+	return true;
+}
+
+/* compile output: append every event instead of playing it */
+void timeline_emit(struct output_t *out, const struct event_t *ev)
+{
+	struct timeline_t *tl = (struct timeline_t *) out->arg;
+
+	if (tl->error)
+		return;
+
+	if (ev->type == EVENT_END) {
+		tl->end = ev->time;
+		return;
+	} else if (ev->type == EVENT_LOOP) {
+		tl->loop_group = tl->groups;
+		tl->loop_time  = ev->time;
+		return;
+	} else if (ev->type == EVENT_DATA) {
+		if (!timeline_emit_data(tl, ev))
+			tl->error = true;
+		return;
+	} else if (ev->type == EVENT_CHIP) {
+		if (ev->frame[0] < SPFM_MAX_SLOT)
+			tl->chip[ev->frame[0]] = ev->frame[1];
+		return;
+	}
+
+	/* a new timestamp opens a new group, and so does the loop point */
+	if (tl->groups == 0 || tl->group[tl->groups - 1].time != ev->time
+		|| tl->groups == tl->loop_group) {
+		if (!timeline_grow((void **) &tl->group, &tl->group_cap, tl->groups,
+			sizeof(struct tl_group_t), TIMELINE_INIT_GROUPS)) {
+			tl->error = true;
+			return;
+		}
+		tl->group[tl->groups++] = (struct tl_group_t){ .time = ev->time, .first = tl->frames };
+	}
+
+	if (!timeline_grow((void **) &tl->frame, &tl->frame_cap, tl->frames,
+		SPFM_FRAME_SIZE, TIMELINE_INIT_FRAMES)) {
+		tl->error = true;
+		return;
+	}
+	memcpy(tl->frame + (size_t) tl->frames * SPFM_FRAME_SIZE, ev->frame, SPFM_FRAME_SIZE);
+	tl->frames++;
+	tl->group[tl->groups - 1].count++;
+}
+
+/*
+ * decode the whole input into tl. a decode error (e.g. truncated file)
+ * keeps everything decoded so far, like playing it directly used to
+ */
+bool timeline_compile(struct timeline_t *tl, struct cursor_t *input,
+	bool (*decode)(struct output_t *out, struct cursor_t *input))
+{
+	struct output_t out;
+	uint64_t start = now_nsec();
+
+	memset(tl, 0, sizeof(struct timeline_t));
+	memset(&out, 0, sizeof(struct output_t));
+	out.emit = timeline_emit;
+	out.arg  = tl;
+	tl->loop_group = UINT32_MAX;
+	for (int slot = 0; slot < SPFM_MAX_SLOT; slot++)
+		tl->chip[slot] = spfm_default_chip[slot];
+
+	decode(&out, input);
+	out_end(&out);
+
+	/* no loop point, or nothing to repeat after it */
+	if (tl->loop_group >= tl->groups || tl->loop_time >= tl->end) {
+		tl->loop_group = tl->groups;
+		tl->loop_time  = 0;
+	}
+
+	if (tl->error) {
+		logging(ERROR, "couldn't allocate timeline (%u frame(s))\n", tl->frames);
+		timeline_die(tl);
+		return false;
+	}
+
+	logging(INFO, "timeline: %u frame(s) in %u group(s), %.1f KB, %.3f sec, compiled in %.3f msec\n",
+		tl->frames, tl->groups,
+		((double) tl->frames * SPFM_FRAME_SIZE + (double) tl->groups * sizeof(struct tl_group_t)
+		+ (double) tl->blocks * sizeof(struct tl_block_t) + tl->data_size) / 1024,
+		(double) tl->end / NSEC_PER_SEC, (double) (now_nsec() - start) / NSEC_PER_MSEC);
+	if (tl->loop_group < tl->groups)
+		logging(INFO, "timeline: loop point at %.3f sec (group %u)\n",
+			(double) tl->loop_time / NSEC_PER_SEC, tl->loop_group);
+
+	return true;
+}
+
+/* first data block sent at or after the frame */
+uint32_t timeline_block_from(const struct timeline_t *tl, uint32_t frame)
+{
+	uint32_t b = 0;
+
+	while (b < tl->blocks && tl->block[b].frame < frame)
+		b++;
+	return b;
+}
+
+/* first upload that isn't over at the frame */
+uint32_t timeline_upload_from(const struct timeline_t *tl, uint32_t frame)
+{
+	uint32_t u = 0;
+
+	while (u < tl->uploads && tl->upload[u].first + tl->upload[u].count <= frame)
+		u++;
+	return u;
+}
+
+/* a frame of the upload: other slots and ports may write in between */
+bool tl_upload_owns(const struct tl_upload_t *upload, const uint8_t *frame)
+{
+	return frame[0] == upload->slot && (frame[1] >> 1) == 0x01;
+}
+
+/* a byte of its data, written register by register (S98) */
+bool tl_upload_data(const struct tl_upload_t *upload, const uint8_t *frame)
+{
+	return tl_upload_owns(upload, frame) && frame[2] == 0x08;
+}
+
+/*
+ * upload whose span has the frame and whose data has been sent already,
+ * NULL if none: a hoisted one, or one begun before frame sent (u: from
+ * timeline_upload_from(), kept up to date)
+ */
+const struct tl_upload_t *timeline_sent(const struct timeline_t *tl, uint32_t *u, uint32_t frame, uint32_t sent)
+{
+	while (*u < tl->uploads && tl->upload[*u].first + tl->upload[*u].count <= frame)
+		(*u)++;
+	return (*u < tl->uploads && (tl->upload[*u].hoisted || tl->upload[*u].first < sent)
+		&& tl->upload[*u].first <= frame) ? &tl->upload[*u]: NULL;
+}
+
+/*
+ * replay the timeline to the output (direct or pipeline) from group first
+ * (at position start), then the loop section loops more times. every pass
+ * is shifted by the loop length, so the output sees one continuous track.
+ * a data block is handed over as one EVENT_UPLOAD pointing into data[].
+ * the data of hoisted uploads has been sent before (hoist_preload(),
+ * keyframe_seek()), and so has the data of an upload begun before first
+ * (keyframe_seek() sends it whole): only their register writes are
+ * played in place. the loop passes play the latter as it is
+ */
+void timeline_play(struct output_t *out, const struct timeline_t *tl,
+	uint32_t first, uint64_t start, int loops)
+{
+	struct event_t ev = { .type = EVENT_WRITE }, upload = { .type = EVENT_UPLOAD };
+	const struct tl_group_t *g = tl->group + first, *end = tl->group + tl->groups;
+	const struct tl_upload_t *sent;
+	const uint8_t *frame;
+	uint64_t shift = 0;
+	uint32_t b, u, seek;
+
+	seek = (g < end) ? g->first: tl->frames;
+	b    = timeline_block_from(tl, seek);
+	u    = timeline_upload_from(tl, seek);
+
+	while (true) {
+		for (; g < end && catch_sigint == false; g++) {
+			ev.time = g->time + shift - start;
+			frame   = tl->frame + (size_t) g->first * SPFM_FRAME_SIZE;
+
+			for (uint32_t i = 0; i < g->count; i++, frame += SPFM_FRAME_SIZE) {
+				sent = timeline_sent(tl, &u, g->first + i, seek);
+				for (; b < tl->blocks && tl->block[b].frame == g->first + i; b++) {
+					if (sent && tl->block[b].slot == sent->slot)
+						continue;
+					upload.time     = ev.time;
+					upload.frame[0] = tl->block[b].slot;
+					upload.data     = tl->data + tl->block[b].offset;
+					upload.count    = tl->block[b].size;
+					out->emit(out, &upload);
+				}
+				if (sent && tl_upload_data(sent, frame))
+					continue;
+				memcpy(ev.frame, frame, SPFM_FRAME_SIZE);
+				out->emit(out, &ev);
+			}
+		}
+
+		if (loops-- <= 0 || tl->loop_group >= tl->groups || catch_sigint)
+			break;
+
+		g      = tl->group + tl->loop_group;
+		shift += tl->end - tl->loop_time;
+		seek   = 0;
+		b      = timeline_block_from(tl, g->first);
+		u      = timeline_upload_from(tl, g->first);
+	}
+
+	ev.time = tl->end + shift - start;
+	ev.type = EVENT_END;
+	out->emit(out, &ev);
+}
+
+/*
+ * a track is played from its compiled timeline or, when the input is
+ * a stream that shouldn't be held in memory (vgz.h), decoded on the fly
+ */
+struct track_t {
+	struct timeline_t tl;
+
+	bool streamed;
+	struct cursor_t input;
+	struct vgz_t vgz; /* streamed: the gzip stream read by input */
+	bool (*decode)(struct output_t *out, struct cursor_t *input);
+
+	/* played from here (see keyframe_seek()) */
+	uint32_t first;
+	uint64_t start;
+
+	/* monotonic time of position 0 (0: when the first event is played) and of the end */
+	uint64_t origin, finish;
+};
+
+void track_play(struct output_t *out, struct track_t *track)
+{
+	if (track->streamed) {
+		track->decode(out, &track->input);
+		/* always terminate the stream, even after a decode error */
+		out_end(out);
+	} else {
+		timeline_play(out, &track->tl, track->first, track->start, opt.loops);
+	}
+}
@@ -0,0 +1,62 @@
+/* See LICENSE for licence details. */
+enum timer_misc_t {
+	NSEC_PER_USEC = 1000,
+	NSEC_PER_MSEC = 1000000,
+	NSEC_PER_SEC  = 1000000000,
+	TIMER_SLACK   = 1,   /* nsec: PR_SET_TIMERSLACK (default slack is 50 usec) */
+};
+
+/* monotonic clock in nsec (never jumps with settimeofday/NTP) */
+uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* tick length as an exact fraction: 1 tick = num / den sec */
+struct timebase_t {
+	uint64_t num, den;
+};
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+/* position of the n-th tick in nsec, without accumulating rounding errors */
+uint64_t ticks_to_nsec(const struct timebase_t *tb, uint64_t ticks)
+{
+	return (uint128_t) ticks * tb->num * NSEC_PER_SEC / tb->den;
+}
+
+/* how late sleep_until() wakes up after its deadline (only when it did wait) */
+struct wakeup_stat_t {
+	uint64_t count; /* number of waits */
+	uint64_t total; /* nsec */
+	uint64_t max;   /* nsec */
+	uint64_t spin;  /* nsec spent busy-waiting (CPU cost of the hybrid wait) */
+};
+
+struct wakeup_stat_t wakeup_stat;
+
+/* timer slack is per thread and inherited: call before creating threads */
+void timer_init(void)
+{
+	errno = 0;
+
+	if (prctl(PR_SET_TIMERSLACK, TIMER_SLACK, 0, 0, 0) < 0)
+		logging(WARN, "prctl(PR_SET_TIMERSLACK): %s\n", strerror(errno));
+}
+
+void wakeup_report(void)
+{
+	if (wakeup_stat.count == 0)
+		return;
+
+	logging(INFO, "wakeup: %llu wait(s), latency avg %.1f usec, max %.1f usec, %.1f msec CPU spent spinning\n",
+		(unsigned long long) wakeup_stat.count,
+		(double) wakeup_stat.total / wakeup_stat.count / NSEC_PER_USEC,
+		(double) wakeup_stat.max / NSEC_PER_USEC,
+		(double) wakeup_stat.spin / NSEC_PER_MSEC);
+
+	memset(&wakeup_stat, 0, sizeof(struct wakeup_stat_t));
+}
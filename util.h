@@ -1,68 +1,155 @@
 /* See LICENSE for licence details. */
-int read_2byte_le(FILE *fp, uint16_t *value)
+/*
+	byte cursor over the input
+
+	every read is bounds-checked. reading past the end logs once, sets
+	the sticky "overrun" flag and returns 0 (or NULL), so a parser can
+	check the flag once per opcode instead of once per field.
+
+	the input is either the whole (memory mapped) file, or a window that
+	slides over a stream (refill != NULL, see vgz.h). offsets given to
+	cursor_seek() are always offsets in the file (base + pos); a stream
+	can only seek forward. a pointer returned by cursor_take() stays
+	valid until the next read, and at most CURSOR_CHUNK bytes should be
+	taken at once from a stream
+*/
+enum cursor_misc_t {
+	CURSOR_CHUNK = 4096,
+};
+
+struct cursor_t {
+	const uint8_t *buf;
+	size_t size, pos;
+	uint64_t base; /* file offset of buf[0] */
+	bool overrun;
+
+	/* streamed input: make at least n bytes available at pos (may move buf[pos] to buf[0]) */
+	bool (*refill)(struct cursor_t *cur, size_t n);
+	void *arg;
+};
+
+void cursor_init(struct cursor_t *cur, const uint8_t *buf, size_t size)
 {
-	int count = 0;
-	uint8_t byte;
+	memset(cur, 0, sizeof(struct cursor_t));
+	cur->buf  = buf;
+	cur->size = size;
+}
 
-	*value = 0;
+/* n bytes are available at pos (quiet, refills a stream) */
+bool cursor_avail(struct cursor_t *cur, size_t n)
+{
+	if (cur->size - cur->pos >= n)
+		return true;
 
-	while (count < 2) {
-		if (fread(&byte, 1, 1, fp) != 1) {
-			logging(ERROR, "read_2byte_le(): fread() failed\n");
-			return -1;
-		}
+	return (cur->refill && cur->refill(cur, n) && cur->size - cur->pos >= n);
+}
 
-		*value |= byte << (BITS_PER_BYTE * count);
-		count++;
+bool cursor_need(struct cursor_t *cur, size_t n)
+{
+	if (cursor_avail(cur, n))
+		return true;
+
+	if (!cur->overrun)
+		logging(ERROR, "unexpected end of data: need %zu byte(s) at 0x%.8llX (size 0x%.8llX)\n",
+			n, (unsigned long long) (cur->base + cur->pos), (unsigned long long) (cur->base + cur->size));
+	cur->overrun = true;
+	cur->pos     = cur->size;
+	return false;
+}
+
+bool cursor_seek(struct cursor_t *cur, uint64_t offset)
+{
+	/* a stream skips forward, dropping the window */
+	while (cur->refill && offset > cur->base + cur->size) {
+		cur->pos = cur->size;
+		if (!cur->refill(cur, 1))
+			break;
+	}
+
+	if (offset < cur->base || offset - cur->base > cur->size) {
+		logging(ERROR, "seek out of range: 0x%.8llX (window 0x%.8llX-0x%.8llX)\n",
+			(unsigned long long) offset, (unsigned long long) cur->base,
+			(unsigned long long) (cur->base + cur->size));
+		cur->overrun = true;
+		return false;
 	}
-	return count;
+	cur->pos = offset - cur->base;
+	return true;
 }
 
-int read_4byte_le(FILE *fp, uint32_t *value)
+bool cursor_skip(struct cursor_t *cur, uint64_t n)
 {
-	int count = 0;
-	uint8_t byte;
+	return cursor_seek(cur, cur->base + cur->pos + n);
+}
 
-	*value = 0;
+/* n bytes in place (no copy), NULL if the file is too short */
+const uint8_t *cursor_take(struct cursor_t *cur, size_t n)
+{
+	const uint8_t *p;
 
-	while (count < 4) {
-		if (fread(&byte, 1, 1, fp) != 1) {
-			logging(ERROR, "read_4byte_le(): fread() failed\n");
-			return -1;
-		}
+	if (!cursor_need(cur, n))
+		return NULL;
 
-		*value |= byte << (BITS_PER_BYTE * count);
-		count++;
-	}
-	return count;
+	p = cur->buf + cur->pos;
+	cur->pos += n;
+	return p;
+}
+
+uint8_t cursor_u8(struct cursor_t *cur)
+{
+	if (!cursor_need(cur, 1))
+		return 0;
+	return cur->buf[cur->pos++];
+}
+
+uint16_t cursor_u16le(struct cursor_t *cur)
+{
+	const uint8_t *p;
+
+	if ((p = cursor_take(cur, 2)) == NULL)
+		return 0;
+	return p[0] | (p[1] << BITS_PER_BYTE);
+}
+
+uint32_t cursor_u32le(struct cursor_t *cur)
+{
+	const uint8_t *p;
+
+	if ((p = cursor_take(cur, 4)) == NULL)
+		return 0;
+	return (uint32_t) p[0] | ((uint32_t) p[1] << BITS_PER_BYTE)
+		| ((uint32_t) p[2] << (BITS_PER_BYTE * 2)) | ((uint32_t) p[3] << (BITS_PER_BYTE * 3));
 }
 
-uint64_t read_variable_length_7bit_le(FILE *fp)
+/* 7 bits per byte, little endian, MSB set: more bytes follow */
+uint64_t cursor_var7le(struct cursor_t *cur)
 {
-	char byte;
+	uint8_t byte;
 	int count = 0;
-	uint64_t nsync = 0L;
+	uint64_t value = 0;
 
 	do {
-		if (fread(&byte, 1, 1, fp) != 1)
-			return -1;
+		if (!cursor_need(cur, 1))
+			return 0;
+		byte = cur->buf[cur->pos++];
 
-		nsync |= (byte & 0x7F) << (7 * count);
+		if (count < 9) /* ignore bits beyond 63 */
+			value |= (uint64_t) (byte & 0x7F) << (7 * count);
 		count++;
 	} while (byte & 0x80);
 
-	return nsync;
+	return value;
 }
 
-bool read_string(FILE *fp, char *str, int size)
+/* copy a LF or NUL terminated string (tag line) */
+bool cursor_string(struct cursor_t *cur, char *str, int size)
 {
-	int c;
 	char *cp;
 
 	cp = str;
 
 	while (1) {
-		if ((c = getc(fp)) == EOF)
+		if (!cursor_avail(cur, 1))
 			return false;
 
 		if (cp - str >= size) {
@@ -70,7 +157,7 @@ bool read_string(FILE *fp, char *str, int size)
 			return false;
 		}
 
-		*cp = c;
+		*cp = cur->buf[cur->pos++];
 
 		if (*cp == 0x0A || *cp == 0x00) {
 			if (*cp == 0x0A)
@@ -89,6 +176,19 @@ bool read_string(FILE *fp, char *str, int size)
 	}
 }
 
+/* 64bit FNV-1a: pass fnv_offset_basis as hash, or a previous result to continue */
+const uint64_t fnv_offset_basis = 0xCBF29CE484222325ULL;
+const uint64_t fnv_prime        = 0x100000001B3ULL;
+
+uint64_t fnv1a(uint64_t hash, const uint8_t *buf, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash ^= buf[i];
+		hash *= fnv_prime;
+	}
+	return hash;
+}
+
 uint8_t low_byte(uint32_t value)
 {
 	return (value & 0xFF);
@@ -36,8 +36,11 @@ enum vgm_misc_t {
 	VGM_HEADER_SIZE         = 0x100,
 	VGM_SAMPLE_RATE         = 44100,
 	VGM_DUAL_CHIP_SUPPORT   = 0x40000000, /* if (VGM_DUAL_CHIP_SUPPORT & header->chip_clock) is true, dual chip enable */
+	VGM_CLOCK_MASK          = 0x3FFFFFFF, /* clock without the dual chip (and chip specific) bits */
+	VGM_DATA_BLOCK_SIZE     = 0x7FFFFFFF, /* data block size without bit 31 (set: data of the second chip) */
 	VGM_DATA_OFFSET_FROM    = 0x34, /* VGM data begins from "VGM_DATA_OFFSET_FROM" + VGM_data_offset */
 	VGM_DEFAULT_DATA_OFFSET = 0x40, /* prior to ver1.50, VGM data begins from VGM_DEFAULT_DATA_OFFSET */
+	VGM_LOOP_OFFSET_FROM    = 0x1C, /* loop point is at "VGM_LOOP_OFFSET_FROM" + loop_offset (0: no loop) */
 	VGM_DEFAULT_WAIT1 = 735,
 	VGM_DEFAULT_WAIT2 = 882,
 };
@@ -93,16 +96,19 @@ struct vgm_header_t {
 	uint32_t extra_header_offset, reserved3[16];
 };
 
-bool vgm_parse_header(FILE *fp, struct vgm_header_t *header)
+bool vgm_parse_header(struct cursor_t *cur, struct vgm_header_t *header)
 {
 	size_t size;
 	long data_offset;
 
 	/* XXX: very rough parsing, It fails on Big Endian CPUs */
-	if ((size = efread(header, 1, VGM_HEADER_SIZE, fp)) != VGM_HEADER_SIZE) {
-		logging(ERROR, "file size (%d bytes) is smaller than VGM header size (%d bytes)\n", size, VGM_HEADER_SIZE);
+	size = cursor_avail(cur, VGM_HEADER_SIZE) ? VGM_HEADER_SIZE: cur->size - cur->pos;
+	if (size < VGM_DEFAULT_DATA_OFFSET) {
+		logging(ERROR, "file size (%zu bytes) is smaller than VGM header size (%d bytes)\n", size, VGM_DEFAULT_DATA_OFFSET);
 		return false;
 	}
+	memset(header, 0, sizeof(struct vgm_header_t));
+	memcpy(header, cur->buf + cur->pos, size);
 
 	logging(DEBUG, "magic: '%c' '%c' '%c' '%c'\n"
 		"\tversion:0x%.4X EOF offest:0x%.8X GD3_offset:0x%.8X\n"
@@ -116,34 +122,102 @@ bool vgm_parse_header(FILE *fp, struct vgm_header_t *header)
 	if (header->version < 0x151) /* YM2608 chip is supported from version 1.51 or later */
 		header->YM2608_clock = 0;
 
-	logging(DEBUG, "YM2151 clock:%u YM2608 clock:%u\n", header->YM2151_clock, header->YM2608_clock);
+	logging(DEBUG, "YM2151 clock:%u%s YM2608 clock:%u%s\n",
+		header->YM2151_clock & VGM_CLOCK_MASK, (header->YM2151_clock & VGM_DUAL_CHIP_SUPPORT) ? " (dual)": "",
+		header->YM2608_clock & VGM_CLOCK_MASK, (header->YM2608_clock & VGM_DUAL_CHIP_SUPPORT) ? " (dual)": "");
 
 	if (header->YM2151_clock == 0 && header->YM2608_clock == 0) {
 		logging(ERROR, "only support YM2151 and YM2608 chip\n");
 		return false;
 	}
 
-	if (header->YM2151_clock & VGM_DUAL_CHIP_SUPPORT
-		|| header->YM2608_clock & VGM_DUAL_CHIP_SUPPORT) {
-		logging(ERROR, "dual chip not supported\n");
-		return false;
-	}
-
 	if (header->version < 0x150 || header->VGM_data_offset == 0)
 		data_offset = VGM_DEFAULT_DATA_OFFSET;
 	else
 		data_offset = VGM_DATA_OFFSET_FROM + header->VGM_data_offset;
 
-	logging(DEBUG, "VGM data from: 0x%.4X\n", data_offset);
-	if (efseek(fp, data_offset, SEEK_SET) < 0)
-		return false;
+	logging(DEBUG, "VGM data from: 0x%.4lX\n", data_offset);
 
-	return true;
+	return cursor_seek(cur, data_offset);
+}
+
+void vgm_wait(struct output_t *out, int nsync)
+{
+	out_wait(out, nsync);
 }
 
-void vgm_wait(int nsync)
+/* chip instances of the file, in -m order */
+enum vgm_device_t {
+	VGM_YM2151 = 0,
+	VGM_YM2151_2,
+	VGM_YM2608,
+	VGM_YM2608_2,
+	VGM_DEVICES,
+};
+
+const char *vgm_device_name[VGM_DEVICES] = {
+	[VGM_YM2151]   = "YM2151",
+	[VGM_YM2151_2] = "YM2151 #2",
+	[VGM_YM2608]   = "YM2608",
+	[VGM_YM2608_2] = "YM2608 #2",
+};
+
+/*
+ * slot of every chip instance in the header: as given by -m (present
+ * instances only, in vgm_device_t order), otherwise the first YM2151 and
+ * YM2608 go to their slots and a second instance takes the slot left free
+ */
+void vgm_route(struct output_t *out, const struct vgm_header_t *header, int *slot)
 {
-	usleep((double) 1.0 / VGM_SAMPLE_RATE * nsync * 1000000);
+	bool present[VGM_DEVICES], used[SPFM_MAX_SLOT] = { false };
+	const enum chip_type_t chip[VGM_DEVICES] = {
+		[VGM_YM2151] = CHIP_OPM, [VGM_YM2151_2] = CHIP_OPM,
+		[VGM_YM2608] = CHIP_OPNA, [VGM_YM2608_2] = CHIP_OPNA,
+	};
+	int route = 0;
+
+	present[VGM_YM2151]   = (header->YM2151_clock & VGM_CLOCK_MASK) != 0;
+	present[VGM_YM2151_2] = present[VGM_YM2151] && (header->YM2151_clock & VGM_DUAL_CHIP_SUPPORT);
+	present[VGM_YM2608]   = (header->YM2608_clock & VGM_CLOCK_MASK) != 0;
+	present[VGM_YM2608_2] = present[VGM_YM2608] && (header->YM2608_clock & VGM_DUAL_CHIP_SUPPORT);
+
+	if (opt.routes == 0) {
+		if (present[VGM_YM2151])
+			used[OPM_SLOT_NUM] = true;
+		if (present[VGM_YM2608])
+			used[OPNA_SLOT_NUM] = true;
+	}
+
+	for (int i = 0; i < VGM_DEVICES; i++) {
+		slot[i] = ROUTE_MUTE;
+		if (!present[i])
+			continue;
+
+		if (opt.routes > 0) {
+			slot[i] = (route < opt.routes) ? opt.route[route]: ROUTE_MUTE;
+			route++;
+		} else if (i == VGM_YM2151) {
+			slot[i] = OPM_SLOT_NUM;
+		} else if (i == VGM_YM2608) {
+			slot[i] = OPNA_SLOT_NUM;
+		} else {
+			for (int s = 0; s < SPFM_MAX_SLOT; s++) {
+				if (!used[s]) {
+					slot[i] = s;
+					used[s] = true;
+					break;
+				}
+			}
+		}
+
+		if (slot[i] == ROUTE_MUTE) {
+			logging(WARN, "%s is muted (see -m)\n", vgm_device_name[i]);
+			continue;
+		}
+
+		out_chip(out, slot[i], chip[i]);
+		logging(DEBUG, "%s -> slot %d\n", vgm_device_name[i], slot[i]);
+	}
 }
 
 /*
@@ -197,70 +271,123 @@ void vgm_wait(int nsync)
 		slot:0x01 port:0x01 addr:0x00 data:0x01
 */
 
-bool opna_adpcm_write(int serial_fd, FILE *input_fp, uint8_t type, uint32_t size)
+bool opna_adpcm_write(struct output_t *out, struct cursor_t *cur, int slot, uint8_t type, uint32_t size)
 {
-	int count, adpcm_size = size - 8; /* size - sizeof(rom_size) (4byte) -  sizeof(start_addr) (4byte) */
-	uint32_t rom_size, start_addr, stop_addr;
-	uint8_t adpcm[adpcm_size];
+	uint32_t count, chunk, adpcm_size, rom_size, start_addr, stop_addr;
+	const uint8_t *adpcm;
 
-	logging(DEBUG, "data block size:%lu\n", size);
+	logging(DEBUG, "data block size:%u\n", size);
 
-	if (efread(&rom_size, 1, 4, input_fp) != 4
-		|| efread(&start_addr, 1, 4, input_fp) != 4)
+	/* blocks of other chips (YM2612 PCM, compressed streams...) */
+	if (type != 0x81) {
+		logging(WARN, "only support YM2608 DELTA-T ROM data (0x%.2X != 0x81)\n", type);
+		cursor_skip(cur, size);
 		return false;
-	logging(DEBUG, "rom size:%lu start addr:0x%.8X adpcm size:%d\n", rom_size, start_addr, adpcm_size);
+	}
 
-	if (efread(adpcm, 1, adpcm_size, input_fp) != (size_t) adpcm_size)
+	if (slot == ROUTE_MUTE) {
+		cursor_skip(cur, size);
 		return false;
+	}
 
-	stop_addr = start_addr + adpcm_size;
-
-	if (type != 0x81) {
-		logging(WARN, "only support YM2608 DELTA-T ROM data (0x%.2X != 0x81)\n", type);
+	if (size < 8) { /* sizeof(rom_size) (4byte) + sizeof(start_addr) (4byte) */
+		logging(ERROR, "data block too small: %u byte(s)\n", size);
+		cursor_skip(cur, size);
 		return false;
 	}
+	adpcm_size = size - 8;
+
+	rom_size   = cursor_u32le(cur);
+	start_addr = cursor_u32le(cur);
+	logging(DEBUG, "rom size:%u start addr:0x%.8X adpcm size:%u\n", rom_size, start_addr, adpcm_size);
 
-	/* debug: write ADPCM data to stdout */
-	//fwrite(adpcm, 1, adpcm_size, stdout);
+	stop_addr = start_addr + adpcm_size;
 
 	/* sequence from YM2608 application manual */
 	//memcpy(adpcm.src + start_addr, adp, adpcm_size);
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x10, 0x13);
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x10, 0x80);
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x00, 0x60);
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x01, 0x02);
-
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x02, low_byte(start_addr));
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x03, high_byte(start_addr));
-
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x04, low_byte(stop_addr));
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x05, high_byte(stop_addr));
-
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x0C, low_byte(stop_addr));
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x0D, high_byte(stop_addr));
-
-	count = 0;
-	while (count < adpcm_size) {
-		spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x08, adpcm[count]);
-		spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x10, 0x1B);
-		spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x10, 0x13);
-		count++;
+	out_write(out, slot, 0x01, 0x10, 0x13);
+	out_write(out, slot, 0x01, 0x10, 0x80);
+	out_write(out, slot, 0x01, 0x00, 0x60);
+	out_write(out, slot, 0x01, 0x01, 0x02);
+
+	out_write(out, slot, 0x01, 0x02, low_byte(start_addr));
+	out_write(out, slot, 0x01, 0x03, high_byte(start_addr));
+
+	out_write(out, slot, 0x01, 0x04, low_byte(stop_addr));
+	out_write(out, slot, 0x01, 0x05, high_byte(stop_addr));
+
+	out_write(out, slot, 0x01, 0x0C, low_byte(stop_addr));
+	out_write(out, slot, 0x01, 0x0D, high_byte(stop_addr));
+
+	/*
+	 * handed over in place, CURSOR_CHUNK bytes at a time: the input may
+	 * be a stream, whose window only holds that much of a large block
+	 */
+	for (count = 0; count < adpcm_size && catch_sigint == false; count += chunk) {
+		chunk = (adpcm_size - count < CURSOR_CHUNK) ? adpcm_size - count: CURSOR_CHUNK;
+		if ((adpcm = cursor_take(cur, chunk)) == NULL)
+			return false;
+		out_data(out, slot, adpcm, chunk);
 	}
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x00, 0x00);
-	spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, 0x10, 0x80);
+	out_write(out, slot, 0x01, 0x00, 0x00);
+	out_write(out, slot, 0x01, 0x10, 0x80);
 
 	return true;
 }
 
-bool vgm_play(int serial_fd, FILE *input_fp)
+/*
+	VGM 1.70 command length (operand bytes following the command byte)
+
+	commands for other chips are skipped by this table in one step,
+	so their operands are never read as commands
+*/
+enum vgm_op_misc_t {
+	VGM_OP_UNDEFINED = -1, /* not in the spec: operand length unknown */
+};
+
+const int8_t vgm_op_length[256] = {
+	/*          0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F */
+	/* 0x00 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	/* 0x10 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	/* 0x20 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	/* 0x30 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1, /* 2nd SN76489, reserved */
+	/* 0x40 */  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  1, /* reserved, GG stereo */
+	/* 0x50 */  1,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2, /* SN76489, YM chips */
+	/* 0x60 */ -1,  2,  0,  0,  3, -1,  0,  6, 11, -1, -1, -1, -1, -1, -1, -1, /* wait, end, data block */
+	/* 0x70 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* wait n+1 */
+	/* 0x80 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* YM2612 DAC + wait n */
+	/* 0x90 */  4,  4,  5, 10,  1,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* DAC stream control */
+	/* 0xA0 */  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2, /* AY8910, 2nd YM chips */
+	/* 0xB0 */  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+	/* 0xC0 */  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,
+	/* 0xD0 */  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,
+	/* 0xE0 */  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4, /* PCM seek, reserved */
+	/* 0xF0 */  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+};
+
+/* number of skipped (not played) commands, by command byte */
+void vgm_report_skipped(const uint64_t *skipped)
 {
-	uint8_t op, buf[BUFSIZE];
+	for (int op = 0; op < 256; op++) {
+		if (skipped[op] == 0)
+			continue;
+		logging(INFO, "vgm: skipped command 0x%.2X x%llu%s\n", op, (unsigned long long) skipped[op],
+			(vgm_op_length[op] == VGM_OP_UNDEFINED) ? " (undefined, operands unknown)": "");
+	}
+}
+
+bool vgm_decode(struct output_t *out, struct cursor_t *cur)
+{
+	uint8_t op, type, dev;
+	const uint8_t *p;
 	uint16_t u16_tmp;
 	uint32_t u32_tmp;
 	int vgm_wait1, vgm_wait2;
+	uint64_t loop_offset, skipped[256] = { 0 };
+	int slot[VGM_DEVICES];
 	struct vgm_header_t header;
 
-	if (vgm_parse_header(input_fp, &header) == false) {
+	if (vgm_parse_header(cur, &header) == false) {
 		logging(ERROR, "vgm_parse_header() failed\n");
 		return false;
 	}
@@ -270,73 +397,109 @@ bool vgm_play(int serial_fd, FILE *input_fp)
 		return false;
 	}
 
+	vgm_route(out, &header, slot);
+
+	/* 1 tick = 1 sample */
+	out->tb = (struct timebase_t){ 1, VGM_SAMPLE_RATE };
+
 	vgm_wait1 = VGM_DEFAULT_WAIT1;
 	vgm_wait2 = VGM_DEFAULT_WAIT2;
 
+	loop_offset = (header.loop_offset != 0) ? VGM_LOOP_OFFSET_FROM + (uint64_t) header.loop_offset: 0;
+
 	//adpcm_rom_reset(serial_fd);
 
 	while (catch_sigint == false) {
-		if (efread(&op, 1, 1, input_fp) != 1)
-			return false;
+		if (loop_offset != 0 && cur->base + cur->pos == loop_offset)
+			out_loop(out);
 
-		logging(DEBUG, "op: 0x%.2X\n", op);
+		op = cursor_u8(cur);
+		if (cur->overrun)
+			return false;
 
 		switch (op) {
 		case 0x54: /* YM2151 */
-			if (efread(buf, 1, 2, input_fp) != 2)
+		case 0xA4: /* YM2151 #2 */
+			if ((p = cursor_take(cur, 2)) == NULL)
 				return false;
-			spfm_send(serial_fd, OPM_SLOT_NUM, 0x00, buf[0], buf[1]);
+			dev = (op == 0x54) ? VGM_YM2151: VGM_YM2151_2;
+			if (slot[dev] != ROUTE_MUTE)
+				out_write(out, slot[dev], 0x00, p[0], p[1]);
+			else
+				skipped[op]++;
 			break;
 		case 0x56: /* YM2608 normal */
 		case 0x57: /* YM2608 extended */
-			if (efread(buf, 1, 2, input_fp) != 2)
+		case 0xA6: /* YM2608 #2 normal */
+		case 0xA7: /* YM2608 #2 extended */
+			if ((p = cursor_take(cur, 2)) == NULL)
 				return false;
-			if (op == 0x56)
-				spfm_send(serial_fd, OPNA_SLOT_NUM, 0x00, buf[0], buf[1]);
-			else if (op == 0x57)
-				spfm_send(serial_fd, OPNA_SLOT_NUM, 0x01, buf[0], buf[1]);
+			dev = (op < 0xA0) ? VGM_YM2608: VGM_YM2608_2;
+			if (slot[dev] != ROUTE_MUTE)
+				out_write(out, slot[dev], op & 0x01, p[0], p[1]);
+			else
+				skipped[op]++;
 			break;
 		case 0x61: /* vgm n wait */
-			if (efread(&u16_tmp, 1, 2, input_fp) != 2)
+			u16_tmp = cursor_u16le(cur);
+			if (cur->overrun)
 				return false;
-			vgm_wait(u16_tmp);
+			vgm_wait(out, u16_tmp);
 			break;
 		case 0x62: /* vgm fixed wait1 */
-			vgm_wait(vgm_wait1);
+			vgm_wait(out, vgm_wait1);
 			break;
 		case 0x63: /* vgm fixed wait2 */
-			vgm_wait(vgm_wait2);
+			vgm_wait(out, vgm_wait2);
 			break;
 		case 0x64: /* vgm reset wait1/wait2 */
-			if (efread(buf, 1, 1, input_fp) != 1
-				|| efread(&u16_tmp, 1, 2, input_fp) != 2)
+			type    = cursor_u8(cur);
+			u16_tmp = cursor_u16le(cur);
+			if (cur->overrun)
 				return false;
-			if (buf[0] == 0x62)
+			if (type == 0x62)
 				vgm_wait1 = u16_tmp;
-			else if (buf[0] == 0x63)
+			else if (type == 0x63)
 				vgm_wait2 = u16_tmp;
 			break;
 		case 0x66: /* end of vgm data */
 			logging(DEBUG, "end of vgm data\n");
+			vgm_report_skipped(skipped);
 			return true;
 		case 0x67: /* data block */
-			if (efread(buf, 1, 2, input_fp) != 2
-				|| efread(&u32_tmp, 1, 4, input_fp) != 4)
+			op      = cursor_u8(cur);
+			type    = cursor_u8(cur);
+			u32_tmp = cursor_u32le(cur);
+			if (cur->overrun)
 				return false;
-			if (buf[0] != 0x66) {
-				logging(ERROR, "invalid sequence: 0x67 0x%.2X (expected 0x67 0x66)\n", buf[0]);
+			if (op != 0x66) {
+				logging(ERROR, "invalid sequence: 0x67 0x%.2X (expected 0x67 0x66)\n", op);
 				return false;
 			}
-			opna_adpcm_write(serial_fd, input_fp, buf[1], u32_tmp);
+			/* bit 31 of the size: data of the second chip */
+			dev = (u32_tmp & ~VGM_DATA_BLOCK_SIZE) ? VGM_YM2608_2: VGM_YM2608;
+			opna_adpcm_write(out, cur, slot[dev], type, u32_tmp & VGM_DATA_BLOCK_SIZE);
 			break;
-		default: /* vgm 1-16 wait */
-			if (0x70 <= op && op <= 0x7F)
-				vgm_wait((op & 0x0F) + 1);
-			else
+		default:
+			if (0x70 <= op && op <= 0x7F) { /* vgm 1-16 wait */
+				vgm_wait(out, (op & 0x0F) + 1);
+				break;
+			}
+
+			/* not for the chips on SPFM Light: skip the operands */
+			skipped[op]++;
+			if (vgm_op_length[op] == VGM_OP_UNDEFINED)
 				logging(DEBUG, "unknown VGM command:0x%.2X\n", op);
+			else if (!cursor_skip(cur, vgm_op_length[op]))
+				return false;
+
+			/* YM2612 DAC write from the data bank, then wait 0-15 */
+			if (0x80 <= op && op <= 0x8F)
+				vgm_wait(out, op & 0x0F);
 			break;
 		}
 	}
 
+	vgm_report_skipped(skipped);
 	return true;
 }
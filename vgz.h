@@ -0,0 +1,127 @@
+/* See LICENSE for licence details. */
+/*
+	streamed gzip input (.vgz, gzipped .s98)
+
+	the file is read VGZ_INPUT_SIZE bytes at a time and inflated into a
+	fixed VGZ_WINDOW_SIZE window that the cursor slides over (see util.h),
+	so memory doesn't depend on the file size and decoding starts after
+	the first window. concatenated gzip members are played as one stream
+*/
+
+enum vgz_misc_t {
+	VGZ_INPUT_SIZE  = 16 * 1024,
+	VGZ_WINDOW_SIZE = 64 * 1024, /* must hold the VGM header and CURSOR_CHUNK */
+};
+
+struct vgz_t {
+	int fd;
+	z_stream zs;
+	bool eof;        /* no more compressed input */
+	bool member_end; /* end of a gzip member: another one may follow */
+	bool done;       /* end of the last gzip member, or error */
+
+	uint8_t in[VGZ_INPUT_SIZE];
+	uint8_t window[VGZ_WINDOW_SIZE];
+
+	/* statistics */
+	uint64_t compressed, refills;
+};
+
+bool vgz_is_gzip(const struct cursor_t *cur)
+{
+	return (cur->size >= 2 && cur->buf[0] == 0x1F && cur->buf[1] == 0x8B);
+}
+
+/* cursor refill: keep the unread bytes and inflate until the window is full */
+bool vgz_refill(struct cursor_t *cur, size_t n)
+{
+	struct vgz_t *z = (struct vgz_t *) cur->arg;
+	size_t keep = cur->size - cur->pos;
+	ssize_t size;
+	int ret;
+
+	if (n > VGZ_WINDOW_SIZE) {
+		logging(ERROR, "vgz: %zu byte(s) don't fit the window (%d bytes)\n", n, VGZ_WINDOW_SIZE);
+		return false;
+	}
+
+	memmove(z->window, z->window + cur->pos, keep);
+	cur->base += cur->pos;
+	cur->pos   = 0;
+	cur->size  = keep;
+	z->refills++;
+
+	while (cur->size < VGZ_WINDOW_SIZE && !z->done) {
+		if (z->zs.avail_in == 0 && !z->eof) {
+			if ((size = eread(z->fd, z->in, VGZ_INPUT_SIZE)) < 0) {
+				z->done = true;
+				break;
+			}
+			z->eof          = (size == 0);
+			z->zs.next_in   = z->in;
+			z->zs.avail_in  = size;
+			z->compressed  += size;
+		}
+
+		if (z->zs.avail_in == 0 && z->eof) {
+			if (!z->member_end)
+				logging(WARN, "vgz: unexpected end of compressed data\n");
+			z->done = true;
+			break;
+		}
+
+		if (z->member_end) {
+			inflateReset(&z->zs);
+			z->member_end = false;
+		}
+
+		z->zs.next_out  = z->window + cur->size;
+		z->zs.avail_out = VGZ_WINDOW_SIZE - cur->size;
+
+		ret = inflate(&z->zs, Z_NO_FLUSH);
+		cur->size = VGZ_WINDOW_SIZE - z->zs.avail_out;
+
+		if (ret == Z_STREAM_END) {
+			z->member_end = true;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			logging(ERROR, "inflate: %s\n", z->zs.msg ? z->zs.msg: "error");
+			z->done = true;
+		}
+	}
+
+	return cur->size >= n;
+}
+
+bool vgz_open(struct vgz_t *z, const char *path, struct cursor_t *cur)
+{
+	int ret;
+
+	memset(z, 0, sizeof(struct vgz_t));
+
+	if ((z->fd = eopen(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	/* 16 + MAX_WBITS: gzip wrapper */
+	if ((ret = inflateInit2(&z->zs, 16 + MAX_WBITS)) != Z_OK) {
+		logging(ERROR, "inflateInit2: %s\n", zError(ret));
+		eclose(z->fd);
+		return false;
+	}
+
+	cursor_init(cur, z->window, 0);
+	cur->refill = vgz_refill;
+	cur->arg    = z;
+
+	return true;
+}
+
+void vgz_close(struct vgz_t *z, const struct cursor_t *cur)
+{
+	logging(INFO, "vgz: %llu KB inflated from %llu KB in %llu refill(s) of a %d KB window\n",
+		(unsigned long long) (cur->base + cur->size) / 1024,
+		(unsigned long long) z->compressed / 1024,
+		(unsigned long long) z->refills, VGZ_WINDOW_SIZE / 1024);
+
+	inflateEnd(&z->zs);
+	eclose(z->fd);
+}
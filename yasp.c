@@ -1,45 +1,192 @@
 /* See LICENSE for licence details. */
 #include "yasp.h"
 #include "error.h"
-#include "spfm.h"
+#include "timer.h"
+#include "rt.h"
+#include "hist.h"
+#include "loop.h"
 #include "util.h"
+#include "spfm.h"
+#include "vgz.h"
+#include "output.h"
+#include "timeline.h"
+#include "keyframe.h"
+#include "hoist.h"
+#include "cache.h"
 #include "vgm.h"
 #include "s98.h"
+#include "pipeline.h"
 #include "play.h"
+#include "playlist.h"
+#include "control.h"
 
 void usage()
 {
 	printf(
-		"usage: yasp FILE\n"
-		"\tavailable format: S98(S98V1/S98V3), VGM(YM2608+ADPCM/YM2151)\n"
+		"usage: yasp [-p] [-r] [-n] [-f] [-l COUNT] [-t POS] [-m SLOTS] [-c CPU] [-s USEC] [-d DEVICE] FILE...\n"
+		"       yasp -D SOCKET [OPTIONS] [FILE...]\n"
+		"       yasp -C SOCKET enqueue FILE|play|pause|stop|skip|status\n"
+		"\t-p: pipeline mode (decode, schedule and transmit on separate threads)\n"
+		"\t-r: real-time mode (lock memory, read the input in at once, SCHED_FIFO)\n"
+		"\t-n: don't use the timeline cache (~/.cache/yasp)\n"
+		"\t-f: fast ADPCM upload (no BRDY flag reset after every byte, if the chip keeps up)\n"
+		"\t-l: loop COUNT more times from the loop point of the file (default 0)\n"
+		"\t-t: start playing the first FILE at POS ([MIN:]SEC, e.g. 3:00 or 95.5)\n"
+		"\t-m: slot of each S98 device in header order, or of each VGM chip in the order\n"
+		"\t    YM2151, YM2151 #2, YM2608, YM2608 #2 (e.g. 1,0 or 1,-: '-' mutes a chip)\n"
+		"\t-c: pin the timing thread to CPU (needs -r)\n"
+		"\t-s: busy-wait the last USEC of every wait (default %d, 0: sleep only)\n"
+		"\t-d: serial device (default %s, a pty of spfmemu also works)\n"
+		"\t-D: daemon mode: play a queue (FILEs first) controlled through SOCKET\n"
+		"\t-C: send a command to the daemon listening on SOCKET\n"
+		"\tSIGINT/SIGTERM: stop (and quit the daemon), SIGTSTP/SIGUSR1: pause/resume\n"
+		"\tavailable format: S98(S98V1/S98V3), VGM(YM2608+ADPCM/YM2151), gzipped (.vgz)\n",
+		DEFAULT_SPIN, serial_dev
 	);
 }
 
-void sig_handler(int signo)
+/* decimal integer in [min, max] */
+bool parse_int(const char *str, long min, long max, int *value)
+{
+	char *end;
+	long num;
+
+	errno = 0;
+	num = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || errno == ERANGE || num < min || num > max)
+		return false;
+
+	*value = num;
+	return true;
+}
+
+/* [MIN:]SEC to nsec */
+bool parse_position(const char *str, uint64_t *nsec)
 {
-	extern volatile sig_atomic_t catch_sigint;
+	char *end;
+	long min = 0;
+	double sec;
+
+	if (strchr(str, ':')) {
+		min = strtol(str, &end, 10);
+		if (*end != ':' || min < 0)
+			return false;
+		str = end + 1;
+	}
 
-	if (signo == SIGINT)
-		catch_sigint = true;
+	sec = strtod(str, &end);
+	if (end == str || *end != '\0' || sec < 0)
+		return false;
+
+	*nsec = (uint64_t) min * 60 * NSEC_PER_SEC + (uint64_t) (sec * NSEC_PER_SEC);
+	return true;
 }
 
-int set_signal(int signo, void (*sig_handler)(int signo))
+/* comma separated slot numbers or '-' (muted), one per S98 device */
+bool parse_route(const char *str)
 {
-	struct sigaction sigact;
+	char *end;
+	long slot;
+
+	for (opt.routes = 0; *str != '\0'; opt.routes++) {
+		if (opt.routes >= ROUTE_MAX)
+			return false;
+
+		if (*str == '-') {
+			opt.route[opt.routes] = ROUTE_MUTE;
+			str++;
+		} else {
+			slot = strtol(str, &end, 10);
+			if (end == str || slot < 0 || slot >= SPFM_MAX_SLOT)
+				return false;
+			opt.route[opt.routes] = slot;
+			str = end;
+		}
 
-	memset(&sigact, 0, sizeof(struct sigaction));
-	sigact.sa_handler = sig_handler;
-	sigact.sa_flags   = SA_RESTART;
-	return esigaction(signo, &sigact, NULL);
+		if (*str == ',')
+			str++;
+		else if (*str != '\0')
+			return false;
+	}
+	return opt.routes > 0;
 }
 
 int main(int argc, char *argv[])
 {
-	int serial_fd = -1;
+	int c, serial_fd = -1, ret = EXIT_SUCCESS;
 	struct termios old_termio;
 
 	/* check args */
-	if (argc <= 1) {
+	while ((c = getopt(argc, argv, "prnfl:t:m:c:s:d:D:C:")) != -1) {
+		switch (c) {
+		case 'p':
+			opt.pipeline = true;
+			break;
+		case 'r':
+			opt.realtime = true;
+			break;
+		case 'n':
+			opt.nocache = true;
+			break;
+		case 'f':
+			opt.fast_upload = true;
+			break;
+		case 'l':
+			if (!parse_int(optarg, 0, INT_MAX, &opt.loops)) {
+				usage();
+				goto err;
+			}
+			break;
+		case 't':
+			if (!parse_position(optarg, &opt.start)) {
+				usage();
+				goto err;
+			}
+			break;
+		case 'm':
+			if (!parse_route(optarg)) {
+				usage();
+				goto err;
+			}
+			break;
+		case 'c':
+			if (!parse_int(optarg, 0, CPU_SETSIZE - 1, &opt.cpu)) {
+				usage();
+				goto err;
+			}
+			break;
+		case 's':
+			if (!parse_int(optarg, 0, SPIN_MAX, &opt.spin)) {
+				usage();
+				goto err;
+			}
+			break;
+		case 'd':
+			serial_dev = optarg;
+			break;
+		case 'D':
+			opt.daemon_socket = optarg;
+			break;
+		case 'C':
+			opt.client_socket = optarg;
+			break;
+		default:
+			usage();
+			goto err;
+		}
+	}
+
+	if (opt.cpu >= 0 && !opt.realtime) {
+		logging(ERROR, "-c needs -r\n");
+		usage();
+		goto err;
+	}
+
+	/* client: nothing to play, the daemon owns the device */
+	if (opt.client_socket)
+		return control_client(opt.client_socket, argc - optind, argv + optind);
+
+	if (optind >= argc && !opt.daemon_socket) {
 		usage();
 		goto err;
 	};
@@ -55,26 +202,40 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
-	if (set_signal(SIGINT, sig_handler) < 0) {
-		logging(FATAL, "set_signal() failed\n");
+	if (loop_init() == false) {
+		logging(FATAL, "loop_init() failed\n");
 		goto err;
 	}
 
-	/* play file */
-	if (play_file(serial_fd, argv[1]) == false) {
-		logging(WARN, "play_file() failed\n");
-		goto err;
+	timer_init();
+
+	if (opt.realtime) {
+		rt_lock_memory();
+		rt_enter(opt.cpu);
+	}
+
+	/* play files: one session, the chips are reset only at both ends */
+	if (opt.daemon_socket) {
+		if (control_run(serial_fd, opt.daemon_socket, argv + optind, argc - optind) == false) {
+			logging(WARN, "control_run() failed\n");
+			ret = EXIT_FAILURE;
+		}
+	} else if (playlist_play(serial_fd, argv + optind, argc - optind) == false) {
+		logging(WARN, "playlist_play() failed\n");
+		ret = EXIT_FAILURE;
 	}
 
 	/* end process */
 	spfm_reset(serial_fd);
 	serial_die(serial_fd, &old_termio);
-	return EXIT_SUCCESS;
+	loop_die();
+	return ret;
 
 err:
 	if (serial_fd != -1) {
 		spfm_reset(serial_fd);
 		serial_die(serial_fd, &old_termio);
 	}
+	loop_die();
 	return EXIT_FAILURE;
 }
@@ -1,7 +1,12 @@
 /* See LICENSE for licence details. */
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -9,19 +14,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 enum misc_t {
 	BITS_PER_BYTE  = 8,
 	BUFSIZE        = 16,
-	SELECT_TIMEOUT = 15000, /* usec */
 	/* SPFM Light slot: 0x00 or 0x01 */
 	OPM_SLOT_NUM   = 0x00,
 	OPNA_SLOT_NUM  = 0x01,
+	DEFAULT_SPIN   = 100, /* usec: busy-wait the last part of every sleep (see sleep_until()) */
+	SPIN_MAX       = 100000, /* usec: -s beyond this is just a busy loop */
+	ROUTE_MAX      = 64,  /* -m: S98 devices (S98_MAX_DEVICE) */
+	ROUTE_MUTE     = -1,  /* -m: device not played */
 };
 
-static const char *serial_dev      = "/dev/ttyUSB0";
+/* command line options */
+struct option_t {
+	bool pipeline; /* -p: decode/schedule/transmit on separate threads */
+	bool realtime; /* -r: mlockall, preloaded input and SCHED_FIFO */
+	bool nocache;  /* -n: always compile, don't read or write the timeline cache */
+	bool fast_upload; /* -f: ADPCM upload without resetting the BRDY flag after every byte */
+	int loops;     /* -l: play the loop section this many more times (0: play once) */
+	uint64_t start; /* -t: start position (nsec) */
+	int route[ROUTE_MAX]; /* -m: slot of each S98 device (ROUTE_MUTE: not played) */
+	int routes;           /* -m: number of routed devices (0: route by device type) */
+	int cpu;       /* -c: pin the timing thread to this cpu (-1: no pinning) */
+	int spin;      /* -s: spin threshold (usec) */
+	const char *daemon_socket; /* -D: play commands from this socket (control.h) */
+	const char *client_socket; /* -C: send a command to the daemon on this socket */
+};
+
+const char *serial_dev             = "/dev/ttyUSB0";
 volatile sig_atomic_t catch_sigint = false;
+struct option_t opt = { .cpu = -1, .spin = DEFAULT_SPIN };